@@ -10,6 +10,50 @@
  */
 
 #include "ASTree.hpp"
+#include "scan.hpp"
+#include <cstring>
+#include <cctype>
+#include <iterator>
+#include <thread>
+#include <sstream>
+
+
+unsigned srcML::threads = 0;
+
+
+/////////////////////////////////////////////////////////////////////
+// srcML of the code the passes insert: a name, a string literal, a
+//  site number, an argument list of expressions and a call of method on
+//  a profile.
+//
+static std::string nameMarkup(const std::string& name) {
+    return "<name>" + escape(name) + "</name>";
+}
+
+static std::string stringMarkup(const std::string& text) {
+    return escape("\"" + text + "\"");
+}
+
+static std::string siteMarkup(std::size_t site) {
+    std::ostringstream text;
+    text << site;
+    return text.str();
+}
+
+static std::string argumentsMarkup(const std::vector<std::string>& expr) {
+    std::string result = "<argument_list>(";
+    for (unsigned long i = 0; i < expr.size(); ++i) {
+        if (i > 0) result += ", ";
+        result += "<argument><expr>" + expr[i] + "</expr></argument>";
+    }
+    return result + ")</argument_list>";
+}
+
+static std::string profileCall(const std::string& profileName, const std::string& method,
+                               const std::vector<std::string>& args) {
+    return "<call><name>" + nameMarkup(profileName) + "." + nameMarkup(method) + "</name>" +
+           argumentsMarkup(args) + "</call>";
+}
 
 
 /////////////////////////////////////////////////////////////////////
@@ -17,9 +61,14 @@
 //
 srcML::srcML(const srcML& actual) {
     header = actual.header;
-    if (actual.tree)
+    source = actual.source;
+    markup = actual.markup;
+    body   = actual.body;
+    siteList = actual.siteList;
+    if (actual.tree) {
         tree   = new AST(*(actual.tree));
-    else
+        tree->buildIndex(index, false);
+    } else
         tree = 0;
 }
 
@@ -30,10 +79,16 @@ void srcML::swap(srcML& b) {
     std::string t_header = header;
     header = b.header;
     b.header = t_header;
+    source.swap(b.source);
+    markup.swap(b.markup);
+    std::swap(body, b.body);
+    siteList.swap(b.siteList);
     
     AST *temp = tree;
     tree = b.tree;
     b.tree = temp;
+
+    index.swap(b.index);
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -48,22 +103,66 @@ srcML& srcML::operator=(srcML rhs) {
 // Reads in and constructs a srcML object.
 //
 std::istream& operator>>(std::istream& in, srcML& src){
-    char ch;
-    if (!in.eof()) in >> ch;
-    src.header = readUntil(in, '>');
-    if (!in.eof()) in >> ch;
+    std::string buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const char* ptr = buffer.data();
+    const char* end = ptr + buffer.size();
+    while (ptr < end && isspace(*ptr)) ++ptr;
+    if (ptr < end) ++ptr;                                   //The <
+    src.header = readUntil(ptr, end, '>');
+    while (ptr < end && isspace(*ptr)) ++ptr;
+    if (ptr < end) ++ptr;                                   //The <
     if (src.tree) delete src.tree;
-    src.tree = new AST(category, readUntil(in, '>'));
-    src.tree->read(in);
+    src.index.clear();
+    src.source.clear();
+    src.tree = new AST(category, readUntil(ptr, end, '>'));
+    src.body = ptr - buffer.data();
+    src.siteList.clear();
+    src.tree->read(ptr, end, src.index, src.source, srcML::threads);
+    src.markup.swap(buffer);
     return in;
 }
 
 
 /////////////////////////////////////////////////////////////////////
-// Prints out a srcML object
+// Prints out a srcML object: the source it was read from with the
+//  text inserted into the tree spliced in.
 //
 std::ostream& operator<<(std::ostream& out, const srcML& src){
-    if (src.tree) src.tree->print(out);
+    if (src.tree) {
+        std::vector<Edit> script;
+        src.editScript(script);
+        patch(out, src.source, script);
+    }
+    return out;
+}
+
+/////////////////////////////////////////////////////////////////////
+// The edit script that turns the source into what is printed.
+//
+void srcML::editScript(std::vector<Edit>& script) const {
+    std::size_t offset = 0;
+    if (tree) tree->edits(script, offset);
+}
+
+/////////////////////////////////////////////////////////////////////
+// The edit script that turns the srcML read into the srcML of what
+//  is printed.
+//
+void srcML::markupScript(std::vector<Edit>& script) const {
+    std::size_t offset = body;
+    if (tree) tree->markupEdits(script, offset);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Prints out a srcML object as srcML: the srcML it was read from,
+//  header and all, with the markup of the inserted nodes spliced in.
+//
+std::ostream& srcML::printMarkup(std::ostream& out) const {
+    if (tree) {
+        std::vector<Edit> script;
+        markupScript(script);
+        patch(out, markup, script);
+    }
     return out;
 }
 
@@ -71,14 +170,14 @@ std::ostream& operator<<(std::ostream& out, const srcML& src){
 //  Adds in the includes and profile variables
 //
 void srcML::mainHeader(const std::vector<std::string>& profileName) {
-    tree->mainHeader(profileName);
+    tree->mainHeader(profileName, index);
 }
 
 /////////////////////////////////////////////////////////////////////
 //  Adds in the includes and profile variables
 //
 void srcML::fileHeader(const std::string& profileName) {
-    tree->fileHeader(profileName);
+    tree->fileHeader(profileName, index);
 }
 
 
@@ -86,25 +185,222 @@ void srcML::fileHeader(const std::string& profileName) {
 // Adds in the report to the main.
 //
 void srcML::mainReport(const std::vector<std::string>& profileName) {
-        tree->mainReport(profileName);
+        tree->mainReport(profileName, index);
 }
 
 /////////////////////////////////////////////////////////////////////
 //  Inserts a filename.count() into each function body.
 //
 void srcML::funcCount(const std::string& profileName) {
-    tree->funcCount(profileName);
+    tree->funcCount(profileName, index, siteList);
 }
 
 /////////////////////////////////////////////////////////////////////
 // Inserts a filename.count() for each statement.
 //
 void srcML::lineCount(const std::string& profileName) {
-    tree->lineCount(profileName);
+    tree->lineCount(profileName, index, siteList);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Appends a table of the sites the passes inserted for profileName,
+//  each with the line its hook has in the printed code, and hands it to
+//  profile::sites.  The passes record each site as they insert it;
+//  entry i is the site they numbered i, so a hook's last argument
+//  indexes the table.  Goes last so it moves no site.
+//
+void srcML::siteTable(const std::string& profileName) {
+    if (tree == 0 || siteList.empty()) return;
+    std::vector<Edit> script;
+    std::map<int, std::pair<std::size_t, std::size_t> > at;      //Site => edit, start in it
+    std::size_t offset = 0;
+    tree->edits(script, offset, &at);
+
+    // Printed line each edit starts on
+    std::vector<int> editLine(script.size());
+    int line = 1;
+    std::size_t from = 0;
+    for (unsigned long e = 0; e < script.size(); ++e) {
+        line += std::count(source.begin() + from, source.begin() + script[e].offset, '\n');
+        from = script[e].offset;
+        editLine[e] = line;
+        line += std::count(script[e].text.begin(), script[e].text.end(), '\n');
+    }
+
+    // Each pass puts its hook on the first line of the code it inserts
+    std::vector<std::string> entries;
+    for (unsigned long i = 0; i < siteList.size(); ++i) {
+        std::ostringstream entry;
+        std::map<int, std::pair<std::size_t, std::size_t> >::const_iterator where = at.find(i);
+        if (where == at.end()) {
+            entry << "{0, 0, 0}";                                //Not printed, never runs
+        } else {
+            const Edit& edit = script[where->second.first];
+            entry << "{" << editLine[where->second.first] +
+                            std::count(edit.text.begin(), edit.text.begin() + where->second.second, '\n')
+                  << ", " << (siteList[i].name  == "" ? "0" : "\"" + siteList[i].name  + "\"")
+                  << ", " << (siteList[i].above == "" ? "0" : "\"" + siteList[i].above + "\"") << "}";
+        }
+        entries.push_back(entry.str());
+    }
+
+    std::ostringstream count;
+    count << entries.size();
+    std::string table = profileName + "_sites";
+    std::string decl = "\n<comment type=\"line\">// Sites of " + escape(profileName) +
+                       ", for the coverage report</comment>\n"
+                       "<decl_stmt><decl><type>" + nameMarkup("static") + " " + nameMarkup("const") + " " +
+                       nameMarkup("profile_site") + "</type> <name>" + nameMarkup(table) +
+                       "<index>[]</index></name> <init>= <expr><block>{\n";
+    for (unsigned long i = 0; i < entries.size(); ++i)
+        decl += "    <expr><block>" + escape(entries[i]) + "</block></expr>,\n";
+    decl += "}</block></expr></init></decl>;</decl_stmt>\n"
+            "<decl_stmt><decl><type>" + nameMarkup("static") + " <name>" + nameMarkup("profile") + "::" +
+            nameMarkup("sites") + "</name></type> " + nameMarkup(table + "_") +
+            argumentsMarkup({nameMarkup(profileName), nameMarkup(table), count.str()}) +
+            "</decl>;</decl_stmt>\n";
+    tree->insert(tree->child.end(), AST::fromMarkup(decl), index);
 }
 
     
 
+/////////////////////////////////////////////////////////////////////
+// Number of nodes in the tree.
+//
+std::size_t srcML::nodeCount() const {
+    return tree ? tree->nodeCount() : 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Appends the file-scope functions and the conditionals the passes
+//  count to result, with their offsets in the source.  Function bodies
+//  are materialized to find their calls.
+// REQUIRES: nothing has been inserted
+//
+void srcML::sites(std::vector<SourceSite>& result) {
+    if (tree == 0) return;
+    const char* functionKinds[] = {"function", "constructor", "destructor"};
+    std::vector<AST*>        functions;
+    std::vector<std::string> functionKind;
+    for (int k = 0; k < 3; ++k) {
+        const std::vector<Posting>& postings = index.find(functionKinds[k]);
+        for (unsigned long i = 0; i < postings.size(); ++i) {
+            if (postings[i].parent != tree) continue;
+            functions.push_back(*postings[i].pos);
+            functionKind.push_back(functionKinds[k]);
+        }
+    }
+    std::vector<SourceSite> found(functions.size());
+    for (unsigned long i = 0; i < functions.size(); ++i) {
+        AST* block = functions[i]->getChild("block");
+        if (block) block->callees(found[i].calls, index);
+    }
+
+    std::map<const AST*, std::pair<std::size_t, std::size_t> > span;
+    std::size_t offset = 0;
+    tree->spans(span, offset);
+
+    for (unsigned long i = 0; i < functions.size(); ++i) {
+        AST* func  = functions[i];
+        AST* name  = func->getChild("name");
+        AST* block = func->getChild("block");
+        if (name == 0 || block == 0 || block->child.empty()) continue;
+        SourceSite& site = found[i];
+        site.kind       = functionKind[i];
+        site.name       = name->getName();
+        site.begin      = span[func].first;
+        site.end        = span[func].second;
+        AST* templ      = func->getChild("template");
+        site.attribute  = templ ? span[templ].second : site.begin;
+        site.counter    = span[block].first + block->child.front()->length;
+        site.counterEnd = site.counter;
+        site.first      = 0;
+        site.tokens     = block->tokenCount();
+        site.isInline   = false;
+        AST* type = func->getChild("type");
+        for (int j = 0; j < 2; ++j) {
+            AST* holder = (j == 0) ? func : type;
+            if (holder == 0) continue;
+            for (std::list<AST*>::const_iterator c = holder->child.begin(); c != holder->child.end(); ++c) {
+                std::ostringstream word;
+                if ((*c)->tag == "specifier") (*c)->print(word);
+                if (word.str() == "inline") site.isInline = true;
+            }
+        }
+        result.push_back(site);
+    }
+
+    const char* kinds[] = {"if", "while", "for", "switch"};
+    for (int k = 0; k < 4; ++k) {
+        const std::vector<Posting>& conditionals = index.find(kinds[k]);
+        for (unsigned long i = 0; i < conditionals.size(); ++i) {
+            if (conditionals[i].stopped) continue;
+            AST* node      = *conditionals[i].pos;
+            AST* condition = node->getCondition();
+            if (condition == 0) continue;
+            SourceSite site;
+            site.kind       = kinds[k];
+            site.begin      = span[node].first;
+            site.end        = span[node].second;
+            site.counter    = span[condition].first;
+            site.counterEnd = span[condition].second;
+            site.attribute  = site.counterEnd;
+            site.first      = 0;
+            site.tokens     = 0;
+            site.isInline   = false;
+            AST* then = node->getChild("then");
+            if (then && then->getChild("block")) then = then->getChild("block");
+            AST* stmt = then ? then->getChild("expr_stmt") : 0;
+            if (stmt) site.first = span[stmt].second;
+            result.push_back(site);
+        }
+    }
+}
+
+    
+
+/////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////
+
+
+/////////////////////////////////////////////////////////////////////
+// Posts the child of parent at pos under its tag.
+//
+void TagIndex::add(AST* parent, std::list<AST*>::iterator pos, bool stopped) {
+    Posting p;
+    p.parent  = parent;
+    p.pos     = pos;
+    p.stopped = stopped;
+    postings[(*pos)->tag].push_back(p);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Appends the postings of chunk, which was built over the children of
+//  holder before they were moved to root.
+//
+void TagIndex::splice(const TagIndex& chunk, AST* holder, AST* root) {
+    typedef std::map<std::string, std::vector<Posting> >::const_iterator Tag;
+    for (Tag i = chunk.postings.begin(); i != chunk.postings.end(); ++i) {
+        std::vector<Posting>& to = postings[i->first];
+        for (unsigned long j = 0; j < i->second.size(); ++j) {
+            to.push_back(i->second[j]);
+            if (to.back().parent == holder) to.back().parent = root;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the postings for tag, empty if no node has that tag.
+//
+const std::vector<Posting>& TagIndex::find(const std::string& tag) const {
+    static const std::vector<Posting> none;
+    std::map<std::string, std::vector<Posting> >::const_iterator i = postings.find(tag);
+    if (i == postings.end()) return none;
+    return i->second;
+}
+
+
 /////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////
 
@@ -114,17 +410,25 @@ void srcML::lineCount(const std::string& profileName) {
 //
 AST::AST(nodes t, const std::string& s) {
     nodeType = t;
+    parent = 0;
+    lazy = false;
+    markupLength = 0;
+    inserted = false;
+    edited = false;
+    site = -1;
     switch (nodeType) {
         case category:
             tag = s;
             break;
         case token:
-            text = unEscape(s);
+            text = s;
+            decodeEntities(text);
             break;
         case whitespace:
             text = s;
             break;
     }
+    length = text.size();
 }
 
 
@@ -159,6 +463,7 @@ AST::AST(const AST& actual) {
 
             // Recursively call the copy ctor
             AST* temp = new AST(*(*i));
+            temp->parent = this;
 
             // Add each new AST to the list of children
             child.push_back(temp);
@@ -166,10 +471,18 @@ AST::AST(const AST& actual) {
     }
 
     // Copy over the elements from actual to this
+    parent = 0;
     text = actual.text;
     nodeType = actual.nodeType;
     tag = actual.tag;
     closeTag = actual.closeTag;
+    lazy = actual.lazy;
+    raw = actual.raw;
+    length = actual.length;
+    markupLength = actual.markupLength;
+    inserted = actual.inserted;
+    edited = actual.edited;
+    site = actual.site;
 }
 
 
@@ -191,15 +504,22 @@ void AST::swap(AST& b) {
     b.closeTag = closeTag;
     closeTag = tempTag;
 
-    // Swap children
-    std::list<AST*> tempList = b.child;
-    b.child = child;
-    child = tempList;
-
-    // Swap text
-    std::string tempText = b.text;
-    b.text = text;
-    text = tempText;
+    // Swap children and point them back at their new parent
+    child.swap(b.child);
+    for (std::list<AST*>::iterator i = child.begin(); i != child.end(); ++i)
+        (*i)->parent = this;
+    for (std::list<AST*>::iterator i = b.child.begin(); i != b.child.end(); ++i)
+        (*i)->parent = &b;
+
+    // Swap text and unparsed contents
+    text.swap(b.text);
+    raw.swap(b.raw);
+    std::swap(lazy, b.lazy);
+    std::swap(length, b.length);
+    std::swap(markupLength, b.markupLength);
+    std::swap(inserted, b.inserted);
+    std::swap(edited, b.edited);
+    std::swap(site, b.site);
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -213,14 +533,16 @@ AST& AST::operator=(AST rhs) {
 
 /////////////////////////////////////////////////////////////////////
 // Returns a pointer to child[i] where (child[i]->tag == tagName)
+//  or 0 if there is no such child.
 //
 // IMPORTANT for milestone 3
 //
 AST* AST::getChild(std::string tagName) {
     std::list<AST*>::iterator ptr = child.begin();
-    while (((*ptr)->tag != tagName) && (ptr != child.end())) {
+    while ((ptr != child.end()) && ((*ptr)->tag != tagName)) {
          ++ptr;
     }
+    if (ptr == child.end()) return 0;
     return *ptr;
 }
 
@@ -239,44 +561,78 @@ std::string AST::getName() const {
         result = child.front()->text;   //A simple name (e.g., main)
     } else {                            //A complex name (e.g., stack::push).
         result = child.front()->child.front()->text;
-        result += "::";
-        result += child.back()->child.front()->text;
+        std::list<AST*>::const_reverse_iterator last = child.rbegin();
+        while ((*last)->tag != "name") ++last;  //Skip template arguments and indices
+        if (*last != child.front()) {
+            result += "::";
+            result += (*last)->child.front()->text;
+        }
     }
     return result;
 }
 
 /////////////////////////////////////////////////////////////////////
-//  Adds in the includes and profile variables in a main file.
+// Returns the condition node of a conditional statement (if, while,
+//  for, switch) or 0 if there is none.  Newer srcML wraps the for
+//  header in a <control> node.
+//
+AST* AST::getCondition() {
+    AST* result = getChild("condition");
+    if (result == 0) {
+        AST* control = getChild("control");
+        if (control) result = control->getChild("condition");
+    }
+    return result;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if this node lies on the parent chain of node.
 //
-void AST::mainHeader(const std::vector<std::string>& profileName) {
+bool AST::isAncestor(const AST* node) const {
+    for (const AST* ptr = node->parent; ptr != 0; ptr = ptr->parent) {
+        if (ptr == this) return true;
+    }
+    return false;
+}
 
-    std::list<AST*>::iterator ptr = child.begin();
-    while (ptr != child.end()) {
-        if ((*ptr)->tag == "function") {
+/////////////////////////////////////////////////////////////////////
+//  Adds in the includes and profile variables in a main file.
+//
+void AST::mainHeader(const std::vector<std::string>& profileName, TagIndex& index) {
+
+    // Find the first function at file scope
+    std::list<AST*>::iterator ptr = child.end();
+    const std::vector<Posting>& functions = index.find("function");
+    for (unsigned long i = 0; i < functions.size(); ++i) {
+        if (functions[i].parent == this) {
+            ptr = functions[i].pos;
             break;
         }
-        ++ptr;
     }
 
     /////////////////////////////////////////////////////////////////////
     // Create include directive
-    AST* cpp_include = new AST(token, "\n\n// Include header for profiling\n#include \"profile.hpp\"\n");
-    child.insert(ptr, cpp_include);
+    AST* cpp_include = AST::fromMarkup("\n\n<comment type=\"line\">// Include header for profiling</comment>\n"
+                                       "<cpp:include>#<cpp:directive>include</cpp:directive> "
+                                       "<cpp:file>\"profile.hpp\"</cpp:file></cpp:include>\n");
+    insert(ptr, cpp_include, index);
     /////////////////////////////////////////////////////////////////////
     // Create profile declaration for each in profileName
     for (unsigned long i = 0; i < profileName.size(); ++i) {
         std::string profName = profileName[i];
-        std::string profileDec = "profile " + profName + "(\"";
         unsigned int lastUnderscoreIndex = 0;
         for (unsigned int j = 0; j < profName.size(); ++j) {
             if (profName[j] == '_') lastUnderscoreIndex = j;
         }
         profName[lastUnderscoreIndex] = '.';
-        profileDec += profName + "\");\n";
+        std::string profileDec = "<decl_stmt><decl><type>" + nameMarkup("profile") + "</type> " +
+                                 nameMarkup(profileName[i]) +
+                                 argumentsMarkup(std::vector<std::string>(1, stringMarkup(profName))) +
+                                 "</decl>;</decl_stmt>\n";
         if (i == profileName.size() - 1) profileDec += "\n";
-        AST* profNode = new AST(token, profileDec);
+        AST* profNode = AST::fromMarkup(profileDec);
 
-        child.insert(ptr, profNode);
+        insert(ptr, profNode, index);
     }
 
 }
@@ -284,27 +640,31 @@ void AST::mainHeader(const std::vector<std::string>& profileName) {
 /////////////////////////////////////////////////////////////////////
 //  Adds in the includes and profile variables for non-main files
 //
-void AST::fileHeader(const std::string& profileName) {
-
-    std::list<AST*>::iterator ptr = child.begin();
-    while (ptr != child.end()) {
-        if ((*ptr)->tag == "function") {
+void AST::fileHeader(const std::string& profileName, TagIndex& index) {
+
+    // Find the first function at file scope
+    std::list<AST*>::iterator ptr = child.end();
+    const std::vector<Posting>& functions = index.find("function");
+    for (unsigned long i = 0; i < functions.size(); ++i) {
+        if (functions[i].parent == this) {
+            ptr = functions[i].pos;
             break;
         }
-        ++ptr;
     }
 
     /////////////////////////////////////////////////////////////////////
     // Create include directive
-    AST* cpp_include = new AST(token, "\n\n// Include header for profiling\n#include \"profile.hpp\"\n");
-    child.insert(ptr, cpp_include);
+    AST* cpp_include = AST::fromMarkup("\n\n<comment type=\"line\">// Include header for profiling</comment>\n"
+                                       "<cpp:include>#<cpp:directive>include</cpp:directive> "
+                                       "<cpp:file>\"profile.hpp\"</cpp:file></cpp:include>\n");
+    insert(ptr, cpp_include, index);
     /////////////////////////////////////////////////////////////////////
     // Create profile declaration for each in profileName
-    std::string profName = profileName;
-    std::string profileDec = "extern profile " + profName + ";\n\n";
-    AST* profNode = new AST(token, profileDec);
+    std::string profileDec = "<decl_stmt><decl><type>" + nameMarkup("extern") + " " + nameMarkup("profile") +
+                             "</type> " + nameMarkup(profileName) + "</decl>;</decl_stmt>\n\n";
+    AST* profNode = AST::fromMarkup(profileDec);
 
-    child.insert(ptr, profNode);
+    insert(ptr, profNode, index);
 
 }
 
@@ -313,46 +673,36 @@ void AST::fileHeader(const std::string& profileName) {
 // Adds in the report to the main.
 // Assumes only one return at end of main body.
 //
-void AST::mainReport(const std::vector<std::string>& profileName) {
+void AST::mainReport(const std::vector<std::string>& profileName, TagIndex& index) {
 
-    std::list<AST*>::iterator ptr = child.begin();
-    std::list<AST*>::iterator innerFunctionPtr;
-    std::list<AST*>::iterator blockPtr;
-    std::vector<std::list<AST*>::iterator> returnList;
-    AST* ptrToMain;
-    std::string profName;
-    std::string outStatement;
-
-    AST* outNode;
+    AST* ptrToMain = 0;
 
     // Finds the function with name "main"
-    while (ptr != child.end()) {
-        if ((*ptr)->tag == "function") {
-            innerFunctionPtr = (*ptr)->child.begin();
-            while (innerFunctionPtr != (*ptr)->child.end()) {
-                if ((*innerFunctionPtr)->tag == "name") {
-                    if ((*((*innerFunctionPtr)->child.begin()))->text == "main") {
-                        ptrToMain = *ptr;
-                    }
-                }
-                ++innerFunctionPtr;
-            }
+    const std::vector<Posting>& functions = index.find("function");
+    for (unsigned long i = 0; i < functions.size(); ++i) {
+        if (functions[i].parent != this) continue;
+        AST* name = (*functions[i].pos)->getChild("name");
+        if (name && name->getName() == "main") {
+            ptrToMain = *functions[i].pos;
         }
-        ++ptr;
     }
+    if (ptrToMain == 0) return;
 
     // Finds the return calls within "main"
-    ptr = ptrToMain->child.begin();
-    ptrToMain->deepScan("return", returnList);
+    std::vector<Posting> returnList;
+    const std::vector<Posting>& returns = index.find("return");
+    for (unsigned long i = 0; i < returns.size(); ++i) {
+        if (!returns[i].stopped && ptrToMain->isAncestor(*returns[i].pos)) {
+            returnList.push_back(returns[i]);
+        }
+    }
 
     for (unsigned long i = 0; i < profileName.size(); ++i) {
-        profName = profileName[i];
-        outStatement = "std::cout << " + profName + " << std::endl;\n\t";
-
-        outNode = new AST(token, outStatement);
-        
+        std::string outStatement = "<expr_stmt><expr><name>" + nameMarkup("std") + "::" + nameMarkup("cout") +
+                                   "</name> &lt;&lt; " + nameMarkup(profileName[i]) + " &lt;&lt; <name>" +
+                                   nameMarkup("std") + "::" + nameMarkup("endl") + "</name></expr>;</expr_stmt>\n\t";
         for (unsigned long j = 0; j < returnList.size(); ++j) {
-            child.insert(returnList[j], outNode);
+            returnList[j].parent->insert(returnList[j].pos, AST::fromMarkup(outStatement), index);
         }
     }
     
@@ -361,44 +711,40 @@ void AST::mainReport(const std::vector<std::string>& profileName) {
 
 /////////////////////////////////////////////////////////////////////
 // Adds in a line to count the number of times each function is executed.
-//  Assumes no nested functions.
+//  The profile::call it declares also marks entry and exit for tracing.
+//  Each is added to sites, its number the next.  Assumes no nested
+//  functions.
 //
-void AST::funcCount(const std::string& profileName) {
+void AST::funcCount(const std::string& profileName, TagIndex& index, std::vector<InsertedSite>& sites) {
 
-    std::list<AST*>::iterator ptr = child.begin();
-    std::list<AST*>::iterator nameFinder;
-    std::list<AST*>::iterator blockPtr;
-    std::string nameOfFunc;
-    std::string countStr;
+    const char* kinds[] = {"function", "constructor", "destructor"};
 
     // Find each function, constructor, and destructor
-    while (ptr != child.end()) {
-        if ((*ptr)->tag == "function" || (*ptr)->tag == "constructor" || (*ptr)->tag == "destructor") {
-            nameFinder = (*ptr)->child.begin();
-            while (nameFinder != (*ptr)->child.end()) {
-                if ((*nameFinder)->tag == "name") {
-                    nameOfFunc = (*nameFinder)->getName();
-                    break;
-                }
-                ++nameFinder;
-            }
-
-            blockPtr = (*ptr)->child.begin();
-            while (blockPtr != (*ptr)->child.end()) {
-                if ((*blockPtr)->tag == "block") {
-                    blockPtr = (*blockPtr)->child.begin();
-                    ++blockPtr;
-                    break;
-                }
-                ++blockPtr;
-            }
-            
-            countStr = " " + profileName + ".count(__LINE__, \"" + nameOfFunc + "\");";
-            AST* func = new AST(token, countStr);
-
-            child.insert(blockPtr, func);
+    for (int k = 0; k < 3; ++k) {
+        const std::vector<Posting>& functions = index.find(kinds[k]);
+        for (unsigned long i = 0; i < functions.size(); ++i) {
+            if (functions[i].parent != this) continue;
+            AST* func  = *functions[i].pos;
+            AST* name  = func->getChild("name");
+            AST* block = func->getChild("block");
+            if (name == 0 || block == 0) continue;
+
+            std::list<AST*>::iterator blockPtr = block->child.begin();
+            ++blockPtr;
+
+            std::vector<std::string> args;
+            args.push_back(nameMarkup(profileName));
+            args.push_back(nameMarkup("__LINE__"));
+            args.push_back(stringMarkup(name->getName()));
+            args.push_back(siteMarkup(sites.size()));
+            std::string countStr = " <decl_stmt><decl><type><name>" + nameMarkup("profile") + "::" +
+                                   nameMarkup("call") + "</name></type> " + nameMarkup("profile_call_") +
+                                   argumentsMarkup(args) + "</decl>;</decl_stmt>";
+            AST* counter = AST::fromMarkup(countStr);
+            counter->site = sites.size();
+            sites.push_back(InsertedSite{name->getName(), ""});
+            block->insert(blockPtr, counter, index);
         }
-        ++ptr;
     }
 
 }
@@ -406,59 +752,218 @@ void AST::funcCount(const std::string& profileName) {
 
 /////////////////////////////////////////////////////////////////////
 // Adds in a line to count the number of times each statement is executed.
+//   Straight-line runs of statements (a basic block) share one counter
+//   placed after the last of them.  It names how many lines above it the
+//   other statements end so the report can give each line its count.
+//   A statement that may throw or not return (mayThrow) ends a run and
+//   gets a counter of its own, so when control leaves it partway every
+//   statement before it is still counted, as with a counter on each.
+//   Overloaded operators are not seen as calls.
+//   Each counter is added to sites, its number the next.
 //   No breaks, returns, throw etc.
 //   Assumes all construts (for, while, if) have { }.
 //
-void AST::lineCount(const std::string& profileName) {
-    std::vector<std::list<AST*>::iterator> expressions; 
-    std::vector<std::list<AST*>::iterator> ifs; 
-    std::vector<std::list<AST*>::iterator> whiles; 
-    std::vector<std::list<AST*>::iterator> fors; 
-    std::vector<std::list<AST*>::iterator> switches; 
-    deepScan("expr_stmt", expressions); 
-    deepScan("if", ifs); 
-    deepScan("while", whiles); 
-    deepScan("for", fors); 
-    deepScan("switch", switches); 
-
+void AST::lineCount(const std::string& profileName, TagIndex& index, std::vector<InsertedSite>& sites) {
+    const std::vector<Posting>& expressions = index.find("expr_stmt");
+    std::set<AST*> done;                   //Statements counted in a block
     for (unsigned long i = 0; i < expressions.size(); ++i) { 
-        std::list<AST*>::iterator tempPtr = expressions[i]; 
+        if (expressions[i].stopped) continue;
+        if (done.count(*expressions[i].pos)) continue;
+
+        // Extend the block over following statements and declarations
+        std::vector<std::list<AST*>::iterator> block;
+        std::list<AST*>::iterator ptr = expressions[i].pos;
+        std::list<AST*>& siblings = expressions[i].parent->child;
+        while (ptr != siblings.end()) {
+            if ((*ptr)->tag == "expr_stmt") {
+                bool leaves = (*ptr)->mayThrow();
+                if (leaves && block.size() > 0) break;
+                block.push_back(ptr);
+                if (leaves) break;
+            } else if (!((*ptr)->isStraightLine()) || ((*ptr)->mayThrow() && block.size() > 0)) {
+                break;
+            }
+            ++ptr;
+        }
+
+        // Lines from the end of each statement to the end of the last
+        std::string above;
+        int lines = 0;
+        for (unsigned long j = block.size() - 1; j > 0; --j) {
+            std::list<AST*>::iterator from = block[j - 1], to = block[j];
+            while (from != to) lines += (*(++from))->newlines();
+            std::ostringstream gap;
+            gap << lines << (above == "" ? "" : " ") << above;
+            above = gap.str();
+            done.insert(*block[j]);
+        }
+
+        std::vector<std::string> args(1, nameMarkup("__LINE__"));
+        if (above != "") args.push_back(stringMarkup(above));
+        args.push_back(siteMarkup(sites.size()));
+        std::string lineCountStr = " <expr_stmt><expr>" +
+                                   profileCall(profileName, above == "" ? "count" : "block", args) +
+                                   "</expr>;</expr_stmt>";
+        AST* counter = AST::fromMarkup(lineCountStr);
+        counter->site = sites.size();
+        sites.push_back(InsertedSite{"", above});
+        std::list<AST*>::iterator tempPtr = block.back(); 
         ++tempPtr;
-        std::string lineCountStr = " " + profileName + ".count(__LINE__);"; 
-        AST* linecount = new AST(token, lineCountStr); 
-        child.insert(tempPtr, linecount); 
+        expressions[i].parent->insert(tempPtr, counter, index); 
     } 
 
-    for (unsigned long i = 0; i < ifs.size(); ++i) { 
-        std::list<AST*>::iterator condition = getCondition(ifs[i]);
-        std::string lineCountStr =  profileName + ".count(__LINE__, \"if condition\")" + ", ";
-        AST* linecount = new AST(token, lineCountStr); 
-        child.insert(condition, linecount); 
-    } 
-    
-    for (unsigned long i = 0; i < whiles.size(); ++i) { 
-        std::list<AST*>::iterator condition = getCondition(whiles[i]);
-        std::string lineCountStr =  profileName + ".count(__LINE__, \"while condition\")" + ", ";
-        AST* linecount = new AST(token, lineCountStr); 
-        child.insert(condition, linecount); 
-    } 
-    
-    for (unsigned long i = 0; i < fors.size(); ++i) { 
-        std::list<AST*>::iterator condition = getCondition(fors[i]);
-        --condition;
-        std::string lineCountStr =  profileName + ".count(__LINE__, \"for condition\")" + ", ";
-        AST* linecount = new AST(token, lineCountStr); 
-        child.insert(condition, linecount); 
-    }
-    
-    for (unsigned long i = 0; i < switches.size(); ++i) { 
-        std::list<AST*>::iterator condition = getCondition(switches[i]);
-        std::string lineCountStr =  profileName + ".count(__LINE__, \"case condition\")" + ", ";
-        AST* linecount = new AST(token, lineCountStr); 
-        child.insert(condition, linecount);
+    const char* kinds[]  = {"if", "while", "for", "switch"};
+    const char* labels[] = {"if condition", "while condition", "for condition", "case condition"};
+    for (int k = 0; k < 4; ++k) {
+        const std::vector<Posting>& conditionals = index.find(kinds[k]);
+        for (unsigned long i = 0; i < conditionals.size(); ++i) { 
+            if (conditionals[i].stopped) continue;
+            AST* condition = (*conditionals[i].pos)->getCondition();
+            if (condition == 0) continue;
+            std::list<AST*>::iterator ptr = condition->child.begin();
+            if (k != 2) ++ptr;         //Skip the ( except in a for
+            std::vector<std::string> args(1, nameMarkup("__LINE__"));
+            args.push_back(stringMarkup(labels[k]));
+            args.push_back(siteMarkup(sites.size()));
+            std::string lineCountStr = "<expr>" + profileCall(profileName, "count", args) + ", </expr>";
+            AST* counter = AST::fromMarkup(lineCountStr);
+            counter->site = sites.size();
+            sites.push_back(InsertedSite{labels[k], ""});
+            condition->insert(ptr, counter, index); 
+        } 
     }
 } 
 
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if control always falls through this node to the next
+//  sibling: declarations, comments and whitespace.  Statements are
+//  checked separately.
+//
+bool AST::isStraightLine() const {
+    if (nodeType == whitespace) return true;
+    if (tag == "decl_stmt" || tag == "empty_stmt") return true;
+    if (tag == "comment type=\"block\"" || tag == "comment type=\"line\"") return true;
+    return false;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns true if this is, or holds, a call, a new or a throw, so
+//  control may leave it partway: by an exception or by a function
+//  that does not return, such as exit.
+//
+bool AST::mayThrow() const {
+    if (lazy) {
+        if (text.find('(') == text.npos && text.find("new") == text.npos &&
+            text.find("throw") == text.npos)
+            return false;
+        AST     parsed(*this);              //Only parsed if it may hold one
+        TagIndex scratch;
+        parsed.materialize(scratch);
+        return parsed.mayThrow();
+    }
+    if (tag == "call") return true;
+    if (nodeType == token && (text == "new" || text == "throw")) return true;
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        if ((*i)->mayThrow()) return true;
+    }
+    return false;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the number of line breaks printed for this subtree.
+//
+int AST::newlines() const {
+    if (nodeType != category || lazy)
+        return static_cast<int>(std::count(text.begin(), text.end(), '\n'));
+    int result = 0;
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        result += (*i)->newlines();
+    }
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Returns the number of nodes in this subtree, counting this one.
+//  An unparsed lazy category counts as one node.
+//
+std::size_t AST::nodeCount() const {
+    std::size_t result = 1;
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        result += (*i)->nodeCount();
+    }
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Returns the number of tokens read for this subtree.  Comments and
+//  preprocessor lines count none; other unparsed nodes count their
+//  words.
+//
+int AST::tokenCount() const {
+    if (inserted || nodeType == whitespace) return 0;
+    if (nodeType == token) return 1;
+    if (tag.compare(0, 7, "comment") == 0 || tag.compare(0, 4, "cpp:") == 0) return 0;
+    if (lazy) {
+        int result = 0;
+        std::istringstream in(text);
+        std::string word;
+        while (in >> word) ++result;
+        return result;
+    }
+    int result = 0;
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        result += (*i)->tokenCount();
+    }
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Records the [begin, end) source offsets of every category below
+//  this node in span.  offset is where this subtree starts and is
+//  advanced past it.  Inserted nodes take up no source.
+//
+void AST::spans(std::map<const AST*, std::pair<std::size_t, std::size_t> >& span,
+                std::size_t& offset) const {
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        if ((*i)->inserted) continue;
+        if ((*i)->nodeType != category || (*i)->lazy) {
+            span[*i] = std::make_pair(offset, offset + (*i)->length);
+            offset += (*i)->length;
+        } else {
+            std::size_t begin = offset;
+            (*i)->spans(span, offset);
+            span[*i] = std::make_pair(begin, offset);
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Adds the name of each function called in this subtree to names,
+//  materializing the unparsed nodes that may hold calls.
+//
+void AST::callees(std::set<std::string>& names, TagIndex& index) {
+    if (nodeType != category) return;
+    if (tag.compare(0, 7, "comment") == 0 || tag.compare(0, 4, "cpp:") == 0) return;
+    materialize(index);
+    if (tag == "call") {
+        AST* name = getChild("name");
+        if (name) {
+            std::ostringstream out;
+            name->print(out);
+            names.insert(out.str());
+        }
+    }
+    for (std::list<AST*>::iterator i = child.begin(); i != child.end(); ++i) {
+        (*i)->callees(names, index);
+    }
+}
+
+
 /////////////////////////////////////////////////////////////////////
 // Searches an AST and returns a vector of list iterators pointing
 // to the AST children that have a tag matching that specified
@@ -480,61 +985,357 @@ std::vector<std::list<AST*>::iterator>& AST::deepScan(std::string searchTag, std
     return vecToPopulate;
 }
 
+
+
 /////////////////////////////////////////////////////////////////////
-// Finds the condition within a conditional statement
-// REQUIRES: an iterator pointing at a conditional statement
+// Read in and construct AST, posting each category in index and
+//  appending the unescaped source to source.
+// REQUIRES: '>' was previous charater read 
+//           && this == new AST(category, "TagName")
 //
-std::list<AST*>::iterator& AST::getCondition(std::list<AST*>::iterator& ptr) { 
-    ptr = (*ptr)->child.begin(); 
-    while (ptr != child.end()) { 
-        if ((*ptr)->tag == "condition") break; 
-        ++ptr; 
-    } 
-    ptr = (*ptr)->child.begin();
-    ++ptr;
-    return ptr;
+//
+std::istream& AST::read(std::istream& in, TagIndex& index, std::string& source) {
+    std::string buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const char* ptr = buffer.data();
+    read(ptr, buffer.data() + buffer.size(), index, source, 1u);
+    return in;
 }
 
-
 /////////////////////////////////////////////////////////////////////
-// Read in and construct AST
+// Read in and construct AST from the buffer [ptr, end) using up to
+//  threads threads (0 for all cores), posting each category in index.
+//  The children are cut at element boundaries into chunks of about
+//  equal size, the chunks are parsed concurrently into subtrees, and
+//  the subtrees are spliced into this node in order.  The tree, index
+//  and source are the same as for reading sequentially.
 // REQUIRES: '>' was previous charater read 
 //           && this == new AST(category, "TagName")
+// ENSURES:  ptr is just past this node's closing tag
 //
+void AST::read(const char*& ptr, const char* end, TagIndex& index, std::string& source, unsigned threads) {
+    const std::size_t minChunk = 1 << 16;
+    if (threads == 0) threads = std::thread::hardware_concurrency();
+    if (threads <= 1 || std::size_t(end - ptr) < 2 * minChunk) {
+        read(ptr, end, index, source, false);
+        return;
+    }
+
+    // Pre-scan for where the child elements start and this node ends
+    std::vector<const char*> starts;
+    const char* close = end;
+    int depth = 0;
+    for (const char* p = ptr; (p = findByte(p, end, '<')) < end; ++p) {
+        if (p + 1 < end && p[1] == '/') {
+            if (depth == 0) { close = p; break; }
+            --depth;
+        } else {
+            if (depth == 0) starts.push_back(p);
+            ++depth;
+        }
+    }
+
+    // Cut into chunks of about equal size at element starts
+    std::size_t target = std::max(std::size_t(close - ptr) / threads, minChunk);
+    std::vector<const char*> cuts(1, ptr);
+    for (unsigned long i = 0; i < starts.size(); ++i) {
+        if (std::size_t(starts[i] - cuts.back()) >= target) cuts.push_back(starts[i]);
+    }
+    cuts.push_back(close);
+    unsigned long chunks = cuts.size() - 1;
+
+    // Parse each chunk into the children of a holder node
+    bool stopped = isStopTag(tag);
+    std::vector<AST*>        holder(chunks);
+    std::vector<TagIndex>    chunkIndex(chunks);
+    std::vector<std::string> chunkSource(chunks);
+    std::vector<std::thread> workers;
+    for (unsigned long i = 0; i < chunks; ++i) {
+        holder[i] = new AST(category, tag);
+        workers.push_back(std::thread([&holder, &chunkIndex, &chunkSource, &cuts, i, stopped]() {
+            const char* p = cuts[i];
+            holder[i]->read(p, cuts[i + 1], chunkIndex[i], chunkSource[i], stopped);
+        }));
+    }
+    length = 0;
+    for (unsigned long i = 0; i < chunks; ++i) {
+        workers[i].join();
+        length += holder[i]->length;
+        source += chunkSource[i];
+        for (std::list<AST*>::iterator j = holder[i]->child.begin(); j != holder[i]->child.end(); ++j)
+            (*j)->parent = this;
+        child.splice(child.end(), holder[i]->child);
+        index.splice(chunkIndex[i], holder[i], this);
+        delete holder[i];
+    }
+
+    // Read this node's closing tag
+    ptr = close;
+    if (ptr < end) {
+        ++ptr;
+        closeTag = readUntil(ptr, end, '>');
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Read in and construct AST, appending the text read to source.
+//  stopped is true if an ancestor of this node is a stop tag.
+//  Stops after this node's closing tag or at end.
 //
-std::istream& AST::read(std::istream& in) {
+void AST::read(const char*& ptr, const char* end, TagIndex& index, std::string& source, bool stopped) {
     AST *subtree;
-    std::string temp, Lws, Rws;
-    char ch;
-    if (!in.eof()) in.get(ch);
-    while (!in.eof()) {
-        if (ch == '<') {                      //Found a tag
-            temp = readUntil(in, '>');
-            if (temp[0] == '/') {
+    std::string temp;
+    stopped = stopped || isStopTag(tag);
+    length = 0;
+    while (ptr < end) {
+        if (*ptr == '<') {                    //Found a tag
+            const char* open = ptr++;
+            temp = readUntil(ptr, end, '>');
+            if (temp.size() > 0 && temp[0] == '/') {
                 closeTag = temp;
                 break;                        //Found close tag, stop recursion
             }
             subtree = new AST(category, temp);               //New subtree
-            subtree->read(in);                               //Read it in
-            in.get(ch);
+            subtree->parent = this;
             child.push_back(subtree);                        //Add it to child
-        } else {                                             //Found a token
-            temp = std::string(1, ch) + readUntil(in, '<');  //Read it in.
-            std::vector<std::string> tokenList = tokenize(temp);
-            for (std::vector<std::string>::const_iterator i=tokenList.begin();
-                 i != tokenList.end();
-                 ++i) {
-                if (isspace((*i)[0])) {
-                    subtree = new AST(whitespace, *i);
+            index.add(this, --child.end(), stopped);         //Post it
+            if (isLazyTag(temp)) {
+                subtree->readRaw(ptr, end);                  //Keep it unparsed
+                source += subtree->text;
+            } else {
+                subtree->read(ptr, end, index, source, stopped);  //Read it in
+            }
+            subtree->markupLength = ptr - open;
+            length += subtree->length;
+        } else {                                             //Found tokens
+            const char* run = ptr;
+            ptr = findByte(ptr, end, '<');
+#ifdef SCAN_CHECK
+            std::vector<std::string> tokenList = tokenize(std::string(run, ptr));
+            std::size_t first = child.size();
+#endif
+            while (run < ptr) {                              //Split at whitespace
+                const char* stop = skipSpace(run, ptr);
+                if (stop == run) {
+                    stop = findSpace(run, ptr);
+                    subtree = new AST(token, std::string(run, stop));
                 } else {
-                    subtree = new AST(token, *i);
+                    subtree = new AST(whitespace, std::string(run, stop));
                 }
+                subtree->parent = this;
+                subtree->markupLength = stop - run;
                 child.push_back(subtree);
+                source += subtree->text;
+                length += subtree->length;
+                run = stop;
             }
-            ch = '<';
+#ifdef SCAN_CHECK
+            std::list<AST*>::const_iterator node = child.begin();
+            std::advance(node, first);
+            for (std::size_t i = 0; i < tokenList.size(); ++i, ++node) {
+                const std::string& t = tokenList[i];
+                bool older = t.find("&quot;") == t.npos && t.find("&apos;") == t.npos &&
+                             t.find("&#") == t.npos && t.find("&amp;amp;") == t.npos;
+                assert(node != child.end());
+                assert(!older || (*node)->text == (isspace(t[0]) ? t : unEscape(t)));
+            }
+            assert(node == child.end());
+#endif
         }
     }
-    return in;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// The text of the srcML [p, end): the tags dropped and the characters
+//  unescaped.  Entities never span tags, so the text is decoded after
+//  they go.
+//
+static std::string markupText(const char* p, const char* end) {
+    std::string result;
+    while (p < end) {
+        const char* open = findByte(p, end, '<');
+        result.append(p, open);
+        p = findByte(open, end, '>');
+        if (p < end) ++p;
+    }
+    decodeEntities(result);
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// A token for code a pass inserts, given as srcML: it prints as the
+//  text of markup and as markup itself in srcML.
+//
+AST* AST::fromMarkup(const std::string& markup) {
+    AST* result = new AST(token);
+    result->raw  = markup;
+    result->text = markupText(markup.data(), markup.data() + markup.size());
+    result->length = result->text.size();
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Reads the contents of a lazy category without parsing them: the
+//  srcML up to the matching closing tag is kept in raw and its text,
+//  with the tags dropped and the characters unescaped, in text.
+// REQUIRES: '>' was previous charater read
+// ENSURES:  ptr is just past this node's closing tag
+//
+void AST::readRaw(const char*& ptr, const char* end) {
+    const char* close = end;
+    int depth = 0;
+    for (const char* p = ptr; (p = findByte(p, end, '<')) < end; ++p) {
+        if (p + 1 < end && p[1] == '/') {
+            if (depth == 0) { close = p; break; }
+            --depth;
+        } else {
+            ++depth;
+        }
+    }
+    lazy = true;
+    raw.assign(ptr, close);
+    text = markupText(ptr, close);
+    length = text.size();
+
+    ptr = close;
+    if (ptr < end) {
+        ++ptr;
+        closeTag = readUntil(ptr, end, '>');
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Parses the contents of a lazy category into children, posting them
+//  in index.  Does nothing if this is already parsed.
+//
+void AST::materialize(TagIndex& index) {
+    if (!lazy) return;
+    bool stopped = false;
+    for (const AST* ptr = parent; ptr != 0; ptr = ptr->parent) {
+        if (isStopTag(ptr->tag)) stopped = true;
+    }
+    std::string contents;
+    contents.swap(raw);
+    text.clear();
+    lazy = false;
+    const char* ptr = contents.data();
+    std::string source;
+    read(ptr, ptr + contents.size(), index, source, stopped);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Posts every category below this node in index.  Used when a tree
+//  is built other than by read (e.g., copied).
+//  stopped is true if an ancestor of this node is a stop tag.
+//
+void AST::buildIndex(TagIndex& index, bool stopped) {
+    stopped = stopped || isStopTag(tag);
+    for (std::list<AST*>::iterator i = child.begin(); i != child.end(); ++i) {
+        if ((*i)->nodeType == category) {
+            index.add(this, i, stopped);
+            (*i)->buildIndex(index, stopped);
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Inserts node as a child before pos and, if it is a category,
+//  posts it in index.  The node becomes an edit of the source.
+//  Returns the position of node.
+// REQUIRES: pos is an iterator into this->child
+//
+std::list<AST*>::iterator AST::insert(std::list<AST*>::iterator pos, AST* node, TagIndex& index) {
+    node->parent = this;
+    node->inserted = true;
+    for (AST* ptr = this; ptr != 0 && !ptr->edited; ptr = ptr->parent)
+        ptr->edited = true;
+    pos = child.insert(pos, node);
+    if (node->nodeType == category) {
+        bool stopped = false;
+        for (const AST* ptr = this; ptr != 0; ptr = ptr->parent) {
+            if (isStopTag(ptr->tag)) stopped = true;
+        }
+        index.add(this, pos, stopped);
+        node->buildIndex(index, stopped);
+    }
+    return pos;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Appends the edit script of this subtree to script: the printed text
+//  of each inserted node at its offset in the original source.  offset
+//  is where this subtree starts and is advanced past it.  Subtrees
+//  with nothing inserted are skipped over by their length.  If sites
+//  is given, each numbered site is mapped to the edit its node went
+//  into and where in that edit's text it starts.
+//
+void AST::edits(std::vector<Edit>& script, std::size_t& offset,
+                std::map<int, std::pair<std::size_t, std::size_t> >* sites) const {
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        if ((*i)->inserted) {
+            std::string snippet = (*i)->text;
+            if ((*i)->nodeType == category && !(*i)->lazy) {
+                std::ostringstream out;
+                (*i)->print(out);
+                snippet = out.str();
+            }
+            if (script.empty() || script.back().offset != offset)
+                script.push_back(Edit{offset, ""});
+            if (sites && (*i)->site >= 0)
+                (*sites)[(*i)->site] = std::make_pair(script.size() - 1, script.back().text.size());
+            script.back().text += snippet;
+        } else if ((*i)->edited) {
+            (*i)->edits(script, offset, sites);
+        } else {
+            offset += (*i)->length;
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Appends the srcML edit script of this subtree to script: the markup
+//  of each inserted node at its offset in the srcML read.  offset is
+//  where this subtree's contents start and is advanced past them.
+//  Subtrees with nothing inserted are skipped over by markupLength.
+//
+void AST::markupEdits(std::vector<Edit>& script, std::size_t& offset) const {
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
+        if ((*i)->inserted) {
+            std::ostringstream out;
+            (*i)->printMarkup(out);
+            if (!script.empty() && script.back().offset == offset)
+                script.back().text += out.str();
+            else
+                script.push_back(Edit{offset, out.str()});
+        } else if ((*i)->edited) {
+            offset += (*i)->tag.size() + 2;                  //<tag>
+            (*i)->markupEdits(script, offset);
+            offset += (*i)->closeTag.size() + 2;             //</tag>
+        } else {
+            offset += (*i)->markupLength;
+        }
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Print an AST as srcML: a category with its tags, and text escaped
+//  again.
+//
+std::ostream& AST::printMarkup(std::ostream& out) const {
+    if (nodeType != category) return out << (raw != "" ? raw : escape(text));
+    out << '<' << tag << '>';
+    if (lazy) out << raw;
+    for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i)
+        (*i)->printMarkup(out);
+    return out << '<' << closeTag << '>';
 }
 
 
@@ -544,8 +1345,8 @@ std::istream& AST::read(std::istream& in) {
 //
 std::ostream& AST::print(std::ostream& out) const {
     for (std::list<AST*>::const_iterator i = child.begin(); i != child.end(); ++i) {
-        if ((*i)->nodeType != category)
-            out << (*i)->text;   //Token or whitespace node
+        if ((*i)->nodeType != category || (*i)->lazy)
+            out << (*i)->text;   //Token, whitespace or unparsed node
         else
             (*i)->print(out);    //Category node
     }
@@ -559,6 +1360,23 @@ std::ostream& AST::print(std::ostream& out) const {
 //
 
 
+/////////////////////////////////////////////////////////////////////
+// Writes source with the edits of script spliced in, copying the
+//  source between edits in whole runs.
+// REQUIRES: script is in increasing offset order within source
+//
+std::ostream& patch(std::ostream& out, const std::string& source, const std::vector<Edit>& script) {
+    std::size_t from = 0;
+    for (std::vector<Edit>::const_iterator i = script.begin(); i != script.end(); ++i) {
+        out.write(source.data() + from, i->offset - from);
+        out.write(i->text.data(), i->text.size());
+        from = i->offset;
+    }
+    out.write(source.data() + from, source.size() - from);
+    return out;
+}
+
+
 /////////////////////////////////////////////////////////////////////
 // This returns true if a syntactic category is encountered that
 //  will not be profiled.
@@ -578,6 +1396,22 @@ bool isStopTag(std::string tag) {
 }
 
 
+/////////////////////////////////////////////////////////////////////
+// This returns true for a syntactic category the passes never look
+//  inside, so the reader keeps it unparsed: the stop tags other than
+//  condition (counts are inserted into it), preprocessor directives,
+//  typedefs and function declarations.
+//
+bool isLazyTag(const std::string& tag) {
+    if (tag == "condition"            ) return false;
+    if (isStopTag(tag)                ) return true;
+    if (tag.compare(0, 4, "cpp:") == 0) return true;
+    if (tag == "typedef"              ) return true;
+    if (tag == "function_decl"        ) return true;
+    return false;
+}
+
+
 /////////////////////////////////////////////////////////////////////
 // Reads until a key is encountered.  Does not include ch.
 // REQUIRES: in.open()
@@ -596,7 +1430,21 @@ std::string readUntil(std::istream& in, char key) {
 
 
 /////////////////////////////////////////////////////////////////////
-// Converts escaped XML charaters back to charater form
+// Reads from ptr until a key is encountered.  Does not include key.
+// ENSURES: ptr is just past key, or end if there is none.
+//          RetVal[i] != key for all i.
+//
+std::string readUntil(const char*& ptr, const char* end, char key) {
+    const char* found = findByte(ptr, end, key);
+    std::string result(ptr, found);
+    ptr = (found == end) ? end : found + 1;
+    return result;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Converts escaped XML charaters back to charater form.  The reader
+//  uses decodeEntities; this is kept to check it under SCAN_CHECK.
 // REQUIRES: s == "&lt;"
 // ENSURES:  RetVal == "<"
 //
@@ -609,6 +1457,26 @@ std::string unEscape(std::string s) {
 }
 
 
+/////////////////////////////////////////////////////////////////////
+// Escapes the charaters srcML escapes in text.
+// REQUIRES: s == "<"
+// ENSURES:  RetVal == "&lt;"
+//
+std::string escape(const std::string& s) {
+    std::string result;
+    result.reserve(s.size());
+    for (std::string::size_type i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+            case '<': result += "&lt;";  break;
+            case '>': result += "&gt;";  break;
+            case '&': result += "&amp;"; break;
+            default:  result += s[i];
+        }
+    }
+    return result;
+}
+
+
 /////////////////////////////////////////////////////////////////////
 // Given: s == "   a + c  "
 // RetVal == {"   ", "a", " ", "+", "c", " "}  
@@ -19,12 +19,17 @@
 #include <list>
 #include <vector>
 #include <string>
+#include <map>
+#include <set>
 #include <algorithm>
 
 
 bool                     isStopTag (std::string);
+bool                     isLazyTag (const std::string&);
 std::string              readUntil (std::istream&, char);
+std::string              readUntil (const char*&, const char*, char);
 std::string              unEscape  (std::string);
+std::string              escape    (const std::string&);
 std::vector<std::string> tokenize  (const std::string& s);
 
 
@@ -36,21 +41,111 @@ std::vector<std::string> tokenize  (const std::string& s);
 //
 enum nodes {category, token, whitespace};
 
+class AST;
+
+////////////////////////////////////////////////////////////////////////
+// A posting is the position of a category node in the tree: the
+//  parent it hangs from and its place in the parent's child list.
+//  stopped is true when the node lies below an isStopTag category.
+//
+struct Posting {
+    AST*                       parent;
+    std::list<AST*>::iterator  pos;
+    bool                       stopped;
+};
+
+////////////////////////////////////////////////////////////////////////
+// TagIndex maps a tag to the postings of every node with that tag,
+//  in document order.  Nodes inside a lazy category are posted when
+//  it is materialized.  It is built by the reader as a by-product of
+//  constructing the tree and kept current by AST::insert.
+//
+// CLASS INV: for each p in find(t): (*p.pos)->parent == p.parent
+//
+class TagIndex {
+public:
+    void                        add  (AST*, std::list<AST*>::iterator, bool);
+    const std::vector<Posting>& find (const std::string&) const;
+    void                        clear()                 { postings.clear(); }
+    void                        swap (TagIndex& b)      { postings.swap(b.postings); }
+    void                        splice(const TagIndex&, AST*, AST*);
+
+private:
+    std::map<std::string, std::vector<Posting> > postings;
+};
+
+////////////////////////////////////////////////////////////////////////
+// An edit inserts text at a byte offset of the original source.  An
+//  edit script is a list of them in increasing offset order.
+//
+struct Edit {
+    std::size_t  offset;
+    std::string  text;
+};
+
+std::ostream& patch(std::ostream&, const std::string&, const std::vector<Edit>&);
+
+
+////////////////////////////////////////////////////////////////////////
+// A profile site a pass inserted: its function or condition name or,
+//  for a basic block, the lines above it.  The site's number is its
+//  index in the list the passes keep and the last argument of its hook.
+//
+struct InsertedSite {
+    std::string  name;          //Function or condition label, or ""
+    std::string  above;         //Block: lines above its last, or ""
+};
+
+
+////////////////////////////////////////////////////////////////////////
+// A function or conditional of the source and the byte offsets where
+//  the passes put its counter, for tools that map a profile back onto
+//  the source.
+//
+struct SourceSite {
+    std::string            kind;        //function, constructor, destructor,
+                                        // if, while, for or switch
+    std::string            name;        //Function: its name
+    std::size_t            begin, end;  //The whole node
+    std::size_t            attribute;   //Function: past any template header
+                                        //if: past its condition
+    std::size_t            counter,     //Function: past the { of its body
+                           counterEnd;  //Conditional: its condition
+    std::size_t            first;       //if: end of the first expression
+                                        // statement of its then part, or 0
+    int                    tokens;      //Function: tokens in its body
+    bool                   isInline;    //Function: declared inline
+    std::set<std::string>  calls;       //Function: names it calls
+};
+
+
 ////////////////////////////////////////////////////////////////////////
 // An AST is either a: 
 //     -Syntactic category node
 //     -Token node
 //     -Whitespace node
 //
-// CLASS INV: if (nodeType == category)
+// A lazy category holds its contents unparsed: raw is the srcML
+//  between its tags and text is what it prints.  It is parsed into
+//  children by materialize when a pass needs to descend into it.
+//
+// A node made by fromMarkup is a token whose raw is its srcML and
+//  whose text is that srcML without tags, so a pass inserts code as
+//  proper elements and both printers stay in step.
+//
+// CLASS INV: if (nodeType == category) && !lazy
 //            than (child != 0) && (text == "")
+//            if (nodeType == category) && lazy
+//            then (child == 0)
 //            if ((nodeType == token) || (nodeType == whitespace))
 //            then (child == 0) && (text != "")
 //
 class AST {
 public:
-                  AST       () {};
-                  AST       (nodes t) : nodeType(t)       {};
+                  AST       () : parent(0), lazy(false), length(0), markupLength(0),
+                                 inserted(false), edited(false), site(-1) {};
+                  AST       (nodes t) : nodeType(t), parent(0), lazy(false), length(0),
+                                        markupLength(0), inserted(false), edited(false), site(-1) {};
                   AST       (nodes t, const std::string&);
                   ~AST      ();
                   AST       (const AST&);
@@ -59,22 +154,58 @@ public:
     AST*          getChild  (std::string);
     std::string   getName   () const;
     
-    void          mainHeader(const std::vector<std::string>&);
-    void          fileHeader(const std::string&);
-    void          mainReport(const std::vector<std::string>&);
-    void          funcCount (const std::string&);
-    void          lineCount (const std::string&);
+    AST*          getCondition();
+    bool          isAncestor(const AST*) const;
+    bool          isStraightLine() const;
+    bool          mayThrow  () const;
+    int           newlines  () const;
+    std::size_t   nodeCount () const;
+    int           tokenCount() const;
+
+    void          mainHeader(const std::vector<std::string>&, TagIndex&);
+    void          fileHeader(const std::string&, TagIndex&);
+    void          mainReport(const std::vector<std::string>&, TagIndex&);
+    void          funcCount (const std::string&, TagIndex&, std::vector<InsertedSite>&);
+    void          lineCount (const std::string&, TagIndex&, std::vector<InsertedSite>&);
     std::ostream& print     (std::ostream&) const;
-    std::istream& read      (std::istream&);
+    std::ostream& printMarkup(std::ostream&) const;
+    void          edits     (std::vector<Edit>&, std::size_t&,
+                             std::map<int, std::pair<std::size_t, std::size_t> >* = 0) const;
+    void          markupEdits(std::vector<Edit>&, std::size_t&) const;
+    void          spans     (std::map<const AST*, std::pair<std::size_t, std::size_t> >&,
+                             std::size_t&) const;
+    void          callees   (std::set<std::string>&, TagIndex&);
+    std::istream& read      (std::istream&, TagIndex&, std::string&);
+    void          read      (const char*&, const char*, TagIndex&, std::string&, unsigned);
+    void          buildIndex(TagIndex&, bool);
+    void          materialize(TagIndex&);
+    std::list<AST*>::iterator insert(std::list<AST*>::iterator, AST*, TagIndex&);
     std::vector<std::list<AST*>::iterator>& deepScan(std::string, std::vector<std::list<AST*>::iterator>&);
-    std::list<AST*>::iterator& getCondition(std::list<AST*>::iterator&);
+    static AST*   fromMarkup(const std::string&);
+
+    friend class  TagIndex;
+    friend class  srcML;
     
 private:
+    void          read      (const char*&, const char*, TagIndex&, std::string&, bool);
+    void          readRaw   (const char*&, const char*);
+
     nodes               nodeType;       //Category, Token, or Whitespace
+    AST*                parent;         //Category node this hangs from.
     std::string         tag,            //Category: the tag name and 
                         closeTag;       //          closing tag.
     std::list<AST*>     child;          //Category: A list of subtrees.
     std::string         text;           //Token/Whitespace: the text.
+                                        //Lazy category: the printed text.
+    bool                lazy;           //Category: contents not yet parsed.
+    std::string         raw;            //Lazy category: the srcML inside.
+                                        //fromMarkup token: its srcML.
+    std::size_t         length;         //Bytes of original source it spans.
+    std::size_t         markupLength;   //Bytes of srcML it was read from.
+    bool                inserted,       //Added by insert, not read.
+                        edited;         //Category: has an inserted descendant.
+    int                 site;           //fromMarkup token: number of the
+                                        // profile site it holds, or -1.
 };
 
 
@@ -84,7 +215,7 @@ private:
 //
 class srcML {
 public:
-            srcML     () : tree(0)    {};
+            srcML     () : body(0), tree(0)  {};
             ~srcML    ()              {delete tree;}
             srcML     (const srcML&);
     void    swap      (srcML&);
@@ -95,13 +226,27 @@ public:
     void    mainReport(const std::vector<std::string>&);
     void    funcCount (const std::string&);
     void    lineCount (const std::string&);
+    void    siteTable (const std::string&);
+    std::size_t nodeCount() const;
+    void    editScript(std::vector<Edit>&) const;
+    void    markupScript(std::vector<Edit>&) const;
+    std::ostream& printMarkup(std::ostream&) const;
+    void    sites     (std::vector<SourceSite>&);
+    const std::string& text() const   {return source;}
     
+    static unsigned threads;            //Parsing threads, 0 for all cores.
+
     friend  std::istream& operator>>(std::istream&, srcML&);
     friend  std::ostream& operator<<(std::ostream&, const srcML&); 
     
 private:
     std::string  header;
+    std::string  source;        //The unescaped source tree was read from.
+    std::string  markup;        //The srcML it was read from, header and all.
+    std::size_t  body;          //Offset in markup of the tree's contents.
+    std::vector<InsertedSite> siteList; //Sites the passes inserted, by number.
     AST*         tree;
+    TagIndex     index;         //Postings for every category in tree.
 };
 
 
@@ -13,11 +13,87 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <set>
 #include <algorithm>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <ctime>
+#include <sys/resource.h>
 
 #include "ASTree.hpp"
+#include "server.hpp"
+#include "report.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// A program in a batch manifest: the name of the instrumented binary,
+//  the main file first, then the other files.
+//
+struct Program {
+    std::string               name;           //Binary to build (p-sort)
+    std::vector<std::string>  file;           //List of file names (foo.cpp.xml)
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// What -f writes for each file, as bits: the instrumented source
+//  (p-foo.cpp), its srcML (p-foo.cpp.xml) or both.
+//
+const unsigned writeSource = 1, writeMarkup = 2;
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocations made by the profiler, counted for --stats.
+//
+std::atomic<unsigned long long> allocations(0);
+
+void* operator new(std::size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// --stats: a point in time, and rows "file<tab>metric<tab>value" written
+//  to stats for each phase of instrumenting a file.  0 when not wanted.
+//
+struct Sample {
+    double              wall, cpu;      //Seconds
+    unsigned long long  allocs;
+};
+
+std::ostream* stats = 0;
+
+Sample sampleNow() {
+    timespec wall, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    Sample result = {wall.tv_sec + wall.tv_nsec * 1e-9, cpu.tv_sec + cpu.tv_nsec * 1e-9,
+                     allocations.load(std::memory_order_relaxed)};
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Writes the time and allocations of phase of file since since, then
+//  restarts since.
+//
+void recordPhase(const std::string& file, const std::string& phase, Sample& since) {
+    if (stats == 0) return;
+    Sample now = sampleNow();
+    *stats << file << '\t' << phase << "_wall_s\t" << now.wall - since.wall << '\n'
+           << file << '\t' << phase << "_cpu_s\t"  << now.cpu - since.cpu   << '\n'
+           << file << '\t' << phase << "_allocs\t" << now.allocs - since.allocs << '\n';
+    since = sampleNow();
+}
+
+void recordValue(const std::string& file, const std::string& metric, unsigned long long value) {
+    if (stats) *stats << file << '\t' << metric << '\t' << value << '\n';
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 // Simple function to exercise/test copy-ctor, dtor, swap, assignment.
@@ -34,64 +110,439 @@ void testCopyAssign(srcML p) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Reads a srcML file into an internal data structure.
-// Then prints out the data structure.
+// Instrumented source of a srcML file: dir/foo.cpp.xml => dir/p-foo.cpp
 //
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        std::cerr << "Error: Input file(s) are required." << std::endl;
-        std::cerr << "       The main must be the first argument followed by ";
-        std::cerr << "any other .cpp files.  For example:" << std::endl;
-        std::cerr << "profiler main.cpp.xml file1.cpp.xml file2.cpp.xml";
-        std::cerr << std::endl << std::endl;
+std::string outputNameOf(const std::string& filename) {
+    std::string::size_type slash = filename.rfind('/') + 1;
+    std::string result = filename.substr(0, slash) + "p-" + filename.substr(slash);
+    return result.substr(0, result.find(".xml"));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Object file for an instrumented source: dir/p-foo.cpp => dir/p-foo.o
+//
+std::string objectNameOf(const std::string& source) {
+    return source.substr(0, source.rfind('.')) + ".o";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A path relative to dir, the client's directory when serving.
+//
+std::string inDir(const std::string& dir, const std::string& path) {
+    if (dir == "" || (path.size() > 0 && path[0] == '/')) return path;
+    return dir + "/" + path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// What the server keeps between requests: parsed files and instrumented
+//  output, keyed by the srcML's contentKey.  0 when not serving.
+//
+struct InstrumentCache {
+    InstrumentCache(std::size_t n) : trees(n), results(n) {};
+    LruCache<srcML>        trees;
+    LruCache<std::string>  results;
+};
+
+InstrumentCache* cache = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads file into text.  Returns false if it cannot be opened.
+//
+bool slurp(const std::string& file, std::string& text) {
+    std::ifstream inFile(file.c_str());
+    if (!inFile) return false;
+    std::ostringstream buffer;
+    buffer << inFile.rdbuf();
+    text = buffer.str();
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Parses srcML text into code, or copies it from the cache.
+//
+void parse(const std::string& text, const std::string& key, srcML& code) {
+    std::shared_ptr<const srcML> tree;
+    if (cache) tree = cache->trees.find(key);
+    if (tree) {
+        code = *tree;
+        return;
+    }
+    std::istringstream in(text);
+    in >> code;
+    if (cache) cache->trees.put(key, std::make_shared<const srcML>(code));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Writes the instrumented result to file.
+//
+void writeResult(const std::string& file, const std::string& result) {
+    std::ofstream outFile(file.c_str());
+    outFile << result;
+    outFile.close();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Finds the outputs of key in the cache.  Returns true if all that
+//  formats asks for are there.
+//
+bool lookup(const std::string& key, unsigned formats,
+            std::shared_ptr<const std::string>& result, std::shared_ptr<const std::string>& markup) {
+    if (cache && (formats & writeSource)) result = cache->results.find(key);
+    if (cache && (formats & writeMarkup)) markup = cache->results.find("xml " + key);
+    return (!(formats & writeSource) || result) && (!(formats & writeMarkup) || markup);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Prints the instrumented code as source, srcML or both, and caches
+//  each under key.
+//
+void output(const srcML& code, const std::string& key, unsigned formats,
+            std::shared_ptr<const std::string>& result, std::shared_ptr<const std::string>& markup) {
+    if (formats & writeSource) {
+        std::ostringstream out;
+        out << code << std::endl;
+        result = std::make_shared<const std::string>(out.str());
+        if (cache) cache->results.put(key, result);
+    }
+    if (formats & writeMarkup) {
+        std::ostringstream out;
+        code.printMarkup(out);
+        markup = std::make_shared<const std::string>(out.str());
+        if (cache) cache->results.put("xml " + key, markup);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Writes the outputs of file that formats asks for.
+//
+void writeOutputs(const std::string& file, const std::string& dir, unsigned formats, std::size_t bytesIn,
+                  const std::shared_ptr<const std::string>& result,
+                  const std::shared_ptr<const std::string>& markup, Sample& t) {
+    if (formats & writeSource) writeResult(inDir(dir, outputNameOf(file)), *result);
+    if (formats & writeMarkup) writeResult(inDir(dir, outputNameOf(file) + ".xml"), *markup);
+    recordPhase(file, "print", t);
+    recordValue(file, "bytes_in", bytesIn);
+    if (formats & writeSource) recordValue(file, "bytes_out", result->size());
+    if (formats & writeMarkup) recordValue(file, "markup_bytes_out", markup->size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruments the main file (file[0]) of a program.
+//  Returns false if the file cannot be opened.
+//
+bool instrumentMain(const std::vector<std::string>& file, const std::vector<std::string>& profileName,
+                    const std::string& dir, unsigned formats) {
+    Sample t = sampleNow();
+    std::string text;
+    if (!slurp(inDir(dir, file[0]), text)) return false;   //Read in the main.
+    std::string tree = contentKey(text), key = "main " + tree;
+    for (unsigned i = 0; i < profileName.size(); ++i) key += " " + profileName[i];
+
+    std::shared_ptr<const std::string> result, markup;
+    if (!lookup(key, formats, result, markup)) {
+        srcML code;
+        parse(text, tree, code);
+        recordPhase(file[0], "read", t);
+        recordValue(file[0], "nodes", code.nodeCount());
+        code.mainHeader(profileName);             //Add in main header info
+        recordPhase(file[0], "header", t);
+        code.mainReport(profileName);             //Add in the report
+        recordPhase(file[0], "mainReport", t);
+        code.funcCount(profileName[0]);           //Count funciton invocations
+        recordPhase(file[0], "funcCount", t);
+        code.lineCount(profileName[0]);           //Count line invocations
+        recordPhase(file[0], "lineCount", t);
+        code.siteTable(profileName[0]);           //List the sites for coverage
+        recordPhase(file[0], "siteTable", t);
+        output(code, key, formats, result, markup);
+    }
+    writeOutputs(file[0], dir, formats, text.size(), result, markup, t);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruments a non-main file of a program.
+//  Returns false if the file cannot be opened.
+//
+bool instrumentFile(const std::string& file, const std::string& profileName, const std::string& dir,
+                    unsigned formats) {
+    Sample t = sampleNow();
+    std::string text;
+    if (!slurp(inDir(dir, file), text)) return false;
+    std::string tree = contentKey(text), key = "file " + tree + " " + profileName;
+
+    std::shared_ptr<const std::string> result, markup;
+    if (!lookup(key, formats, result, markup)) {
+        srcML code;
+        parse(text, tree, code);
+        recordPhase(file, "read", t);
+        recordValue(file, "nodes", code.nodeCount());
+        code.fileHeader(profileName);             //Add in file header info
+        recordPhase(file, "header", t);
+        code.funcCount(profileName);              //Count funciton invocations
+        recordPhase(file, "funcCount", t);
+        code.lineCount(profileName);              //Count line invocations
+        recordPhase(file, "lineCount", t);
+        code.siteTable(profileName);              //List the sites for coverage
+        recordPhase(file, "siteTable", t);
+        output(code, key, formats, result, markup);
+    }
+    writeOutputs(file, dir, formats, text.size(), result, markup, t);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads a manifest.  Each line names a program followed by its main
+//  file and then any other files.  Blank lines and # comments are skipped.
+//  For example:
+//      p-sort   sort.cpp.xml  sort_lib.cpp.xml
+//
+std::vector<Program> readManifest(std::istream& in) {
+    std::vector<Program> result;
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        Program prog;
+        std::string filename;
+        if (!(fields >> prog.name)) continue;
+        while (fields >> filename) prog.file.push_back(filename);
+        result.push_back(prog);
+    }
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Writes a Makefile fragment that builds every program in the manifest
+//  against a prebuilt profile runtime.  Each object has its own rule so
+//  the programs build in parallel with make -j.
+//
+void writeMakefile(std::ostream& out, const std::vector<Program>& programs, const std::string& manifest) {
+    std::set<std::string> objects;
+
+    out << "# Generated by profiler from " << manifest << ".  Do not edit.\n";
+    out << "CPP         ?= clang++\n";
+    out << "CPP_OPTS    ?= -g -Wall -W -Wunused -Wuninitialized -Wshadow -std=c++11\n";
+    out << "PROFILE_DIR ?= .\n";
+    out << "PROFILE_RT  ?= $(PROFILE_DIR)/profile.o\n";
+    out << "PROFILE_LIBS?= -ldl\n\n";
+    out << "PROFILED =";
+    for (unsigned i = 0; i < programs.size(); ++i) out << " " << programs[i].name;
+    out << "\n\nall-profiled: $(PROFILED)\n\n";
+
+    for (unsigned i = 0; i < programs.size(); ++i) {
+        std::string objs;
+        for (unsigned j = 0; j < programs[i].file.size(); ++j)
+            objs += " " + objectNameOf(outputNameOf(programs[i].file[j]));
+        out << programs[i].name << ":" << objs << " $(PROFILE_RT)\n";
+        out << "\t$(CPP) $(CPP_OPTS) -o $@" << objs << " $(PROFILE_RT) $(PROFILE_LIBS)\n\n";
+    }
+
+    for (unsigned i = 0; i < programs.size(); ++i) {
+        for (unsigned j = 0; j < programs[i].file.size(); ++j) {
+            std::string source = outputNameOf(programs[i].file[j]);
+            std::string object = objectNameOf(source);
+            if (!objects.insert(object).second) continue;
+            out << object << ": " << source << " $(PROFILE_DIR)/profile.hpp\n";
+            out << "\t$(CPP) $(CPP_OPTS) -I$(PROFILE_DIR) -MMD -MP -c " << source << " -o $@\n\n";
+        }
+    }
+
+    out << "clean-profiled:\n\trm -f $(PROFILED)";
+    for (std::set<std::string>::const_iterator i = objects.begin(); i != objects.end(); ++i)
+        out << " " << *i;
+    out << "\n\n.PHONY: all-profiled clean-profiled\n\n";
+    out << "-include $(wildcard";
+    for (std::set<std::string>::const_iterator i = objects.begin(); i != objects.end(); ++i)
+        out << " " << i->substr(0, i->rfind('.')) << ".d";
+    out << ")\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Instruments every program in a manifest and writes a Makefile fragment.
+//  A file shared by several programs is instrumented once.  A file may
+//  not be the main of one program and an ordinary file of another.
+//  Paths are relative to dir.  Errors are written to err.
+//
+int batch(const std::string& manifest, const std::string& makefile,
+          const std::string& dir, unsigned formats, std::ostream& err) {
+    std::ifstream in(inDir(dir, manifest).c_str());
+    if (!in) {
+        err << "Error: Cannot open manifest " << manifest << std::endl;
+        return(1);
+    }
+    std::vector<Program> programs = readManifest(in);
+    in.close();
+
+    std::set<std::string> mains, others;
+    for (unsigned i = 0; i < programs.size(); ++i) {
+        if (programs[i].file.size() == 0) {
+            err << "Error: " << manifest << ": " << programs[i].name;
+            err << " lists no files." << std::endl;
+            return(1);
+        }
+        mains.insert(programs[i].file[0]);
+        for (unsigned j = 1; j < programs[i].file.size(); ++j)
+            others.insert(programs[i].file[j]);
+    }
+    for (std::set<std::string>::const_iterator i = mains.begin(); i != mains.end(); ++i) {
+        if (others.count(*i)) {
+            err << "Error: " << *i << " is both a main and a non-main file." << std::endl;
+            return(1);
+        }
+    }
+
+    std::set<std::string> done;
+    for (unsigned i = 0; i < programs.size(); ++i) {
+        const std::vector<std::string>& file = programs[i].file;
+        std::vector<std::string> profileName;
+        for (unsigned j = 0; j < file.size(); ++j)
+            profileName.push_back(profileNameOf(file[j]));
+
+        for (unsigned j = 0; j < file.size(); ++j) {
+            if (!done.insert(file[j]).second) continue;
+            bool ok = (j == 0) ? instrumentMain(file, profileName, dir, formats)
+                               : instrumentFile(file[j], profileName[j], dir, formats);
+            if (!ok) {
+                err << "Error: Cannot open " << file[j] << std::endl;
+                return(1);
+            }
+        }
+    }
+
+    std::ofstream out(inDir(dir, makefile).c_str());
+    writeMakefile(out, programs, manifest);
+    out.close();
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Runs a profiler command line (without the server options) with paths
+//  relative to dir, writing errors to err.  Returns the exit status.
+//
+int run(const std::vector<std::string>& args, const std::string& dir, std::ostream& err) {
+    std::size_t first = 0;                    //First file argument
+    std::string manifest, makefile = "profile.mk";
+    unsigned formats = writeSource;
+    while (first + 1 < args.size() && args[first][0] == '-') {
+        const std::string& opt = args[first];
+        if      (opt == "-m") manifest = args[first + 1];
+        else if (opt == "-o") makefile = args[first + 1];
+        else if (opt == "-f") {
+            const std::string& format = args[first + 1];
+            formats = (format == "cpp") ? writeSource : (format == "xml") ? writeMarkup :
+                      (format == "both") ? writeSource | writeMarkup : 0;
+            if (formats == 0) {
+                err << "Error: -f takes cpp, xml or both." << std::endl;
+                return(1);
+            }
+        }
+        else break;
+        first += 2;
+    }
+    if (manifest != "") return batch(manifest, makefile, dir, formats, err);
+    if (first >= args.size()) {
+        err << "Error: Input file(s) are required." << std::endl;
+        err << "       The main must be the first argument followed by ";
+        err << "any other .cpp files.  For example:" << std::endl;
+        err << "profiler main.cpp.xml file1.cpp.xml file2.cpp.xml";
+        err << std::endl;
+        err << "       Or a manifest of programs, one per line, to ";
+        err << "instrument together with a Makefile fragment:" << std::endl;
+        err << "profiler -m manifest [-o profile.mk]";
+        err << std::endl;
+        err << "       -j n parses each file with n threads (default: all cores).";
+        err << std::endl;
+        err << "       -f xml writes the instrumented srcML (p-foo.cpp.xml) instead";
+        err << std::endl;
+        err << "       of the source, -f both writes both.";
+        err << std::endl;
+        err << "       profiler --serve [-w workers] [-c entries] [-s socket] runs a";
+        err << std::endl;
+        err << "       server; -s socket or PROFILER_SOCKET sends commands to it.";
+        err << std::endl;
+        err << "       --stats writes the time of each phase to standard output.";
+        err << std::endl << std::endl;
         return(1);
     }
     
-    srcML                     code;           //Source code to be profiled.
     std::vector<std::string>  file;           //List of file names (foo.cpp.xml)
     std::vector<std::string>  profileName;    //List of profile names (foo_cpp)
     
-    for (int i = 1; i < argc; ++i) {
-        std::string filename;
-        filename = argv[i];
-        file.push_back(filename);
-        filename = filename.substr(0, filename.find(".xml"));      //Remove .xml
-        std::replace(filename.begin(), filename.end(), '.', '_');  //. => _
-        profileName.push_back(filename);
+    for (std::size_t i = first; i < args.size(); ++i) {
+        file.push_back(args[i]);
+        profileName.push_back(profileNameOf(args[i]));
     }
     
-    std::ifstream inFile(file[0].c_str());    //Read in the main.
-    inFile >> code;
-    inFile.close();
-    
-    code.mainHeader(profileName);             //Add in main header info
-    code.mainReport(profileName);             //Add in the report
-    code.funcCount(profileName[0]);           //Count funciton invocations
-    code.lineCount(profileName[0]);           //Count line invocations
-    
-    std::string outFileName = "p-" + file[0];
-    outFileName = outFileName.substr(0, outFileName.find(".xml"));
-    std::ofstream outFile(outFileName.c_str());
-    outFile << code << std::endl;
-    outFile.close();
-
+    if (!instrumentMain(file, profileName, dir, formats)) {
+        err << "Error: Cannot open " << file[0] << std::endl;
+        return(1);
+    }
     for (unsigned i = 1; i < file.size(); ++i) {  //Read rest of the files.
-        inFile.open(file[i].c_str());
-        inFile >> code;
-        inFile.close();
-        
-        code.fileHeader(profileName[i]);       //Add in file header info
-        code.funcCount(profileName[i]);        //Count funciton invocations
-        code.lineCount(profileName[i]);        //Count line invocations
-        
-        outFileName = "p-" + file[i];
-        outFileName = outFileName.substr(0, outFileName.find(".xml"));
-        outFile.open(outFileName.c_str());
-        outFile << code << std::endl;
-        outFile.close();
+        if (!instrumentFile(file[i], profileName[i], dir, formats)) {
+            err << "Error: Cannot open " << file[i] << std::endl;
+            return(1);
+        }
     }
-
-	return 0;
+    return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Reads a srcML file into an internal data structure.
+// Then prints out the data structure.
+//  The server options may come first: --serve runs a server on the
+//  socket (-s, else PROFILER_SOCKET, else a per-user default) with -w
+//  workers and -c cache entries.  Otherwise, given a socket, the
+//  command is sent to the server there, or run here if none answers.
+//  -j n sets the threads this process parses with, the server's with
+//  --serve; it is not sent to a server.
+//  --stats runs here and writes, as tab separated "file metric value"
+//  rows, each phase's wall and CPU time and allocations, each file's
+//  nodes and bytes, and the totals and peak RSS as file "*".
+//
+int main(int argc, char *argv[]) {
+    std::vector<std::string> args;
+    const char* env = getenv("PROFILER_SOCKET");
+    std::string socket = env ? env : "";
+    bool        serving = false, statistics = false;
+    unsigned    workers = 0, entries = 64;
+    int         i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        std::string opt = argv[i];
+        if      (opt == "--serve")                serving = true;
+        else if (opt == "--stats")                statistics = true;
+        else if (opt == "-s" && i + 1 < argc)     socket  = argv[++i];
+        else if (opt == "-w" && i + 1 < argc)     workers = atoi(argv[++i]);
+        else if (opt == "-c" && i + 1 < argc)     entries = atoi(argv[++i]);
+        else if (opt == "-j" && i + 1 < argc)     srcML::threads = atoi(argv[++i]);
+        else if (i + 1 < argc) {                  //An option of run
+            args.push_back(argv[i]);
+            args.push_back(argv[++i]);
+        } else break;
+    }
+    args.insert(args.end(), argv + i, argv + argc);
+
+    if (serving) {
+        InstrumentCache resident(entries);
+        cache = &resident;
+        return serve(socket == "" ? defaultSocket() : socket, workers,
+                     [](const std::vector<std::string>& request, const std::string& dir, std::ostream& err) {
+                         return run(request, dir, err);
+                     });
+    }
+    int status;
+    if (!statistics && socket != "" && callServer(socket, args, status)) return status;
+    if (!statistics) return run(args, "", std::cerr);
 
+    stats = &std::cout;
+    std::cout << "file\tmetric\tvalue\n";
+    Sample start = sampleNow();
+    start.cpu = 0;                            //Count from process start
+    start.allocs = 0;
+    status = run(args, "", std::cerr);
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    recordPhase("*", "total", start);
+    recordValue("*", "peak_rss_kb", usage.ru_maxrss);
+    return status;
+}
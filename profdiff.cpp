@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+//  profdiff.cpp
+//  Profiler
+//
+//  Compares two sets of profile reports, a baseline and a candidate,
+//   for example p-sort run over several seeds before and after a change.
+//  Sites are aligned by file, function and line offset within the
+//   function, so edits above a function do not misalign its lines.
+//  Reports mean counts (and times when the report has them), absolute
+//   and relative deltas, and Welch's t-test p-value over the runs.
+//   A site whose runs agree on each side, as exact counts do, has no
+//   test: its p-value is given as "exact", the delta being certain.
+//  Rows are ranked by impact: |delta| as a fraction of the metric's total.
+//
+//  Usage: profdiff [-n top] base.out ... -- cand.out ...
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#include "report.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Samples of one metric of one aligned site, one per run.
+//
+struct Site {
+    std::string          file, function, label, metric;
+    int                  offset;
+    std::vector<double>  base, cand;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds one run's rows to the sites, as sample number run of base or cand.
+//  Each row belongs to the function in its file whose entry line is the
+//  closest at or above it.
+//
+void addRun(const std::vector<ReportRow>& rows, bool isBase, unsigned run,
+            std::unordered_map<std::string, Site>& sites) {
+    std::map<std::string, std::map<int, std::string> > entries;   //file -> line -> func
+    for (unsigned i = 0; i < rows.size(); ++i) {
+        if (isFunction(rows[i].name)) entries[rows[i].file][rows[i].line] = rows[i].name;
+    }
+
+    for (unsigned i = 0; i < rows.size(); ++i) {
+        const ReportRow& row = rows[i];
+        std::string function;
+        int offset = row.line;
+        const std::map<int, std::string>& funcs = entries[row.file];
+        std::map<int, std::string>::const_iterator f = funcs.upper_bound(row.line);
+        if (f != funcs.begin()) {
+            --f;
+            function = f->second;
+            offset   = row.line - f->first;
+        }
+
+        for (int m = 0; m < (row.timed ? 2 : 1); ++m) {
+            std::string metric = (m == 0) ? "count" : "time";
+            std::ostringstream key;
+            key << row.file << '\t' << function << '\t' << offset << '\t' << row.name << '\t' << metric;
+            Site& site = sites[key.str()];
+            if (site.metric == "") {
+                site.file = row.file;   site.function = function;
+                site.label = row.name;  site.offset = offset;
+                site.metric = metric;
+            }
+            std::vector<double>& samples = isBase ? site.base : site.cand;
+            samples.resize(run + 1, 0);
+            samples[run] += (m == 0) ? row.count : row.time;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Mean and sample variance.
+//
+void meanVar(const std::vector<double>& x, double& mean, double& var) {
+    mean = 0; var = 0;
+    if (x.size() == 0) return;
+    for (unsigned i = 0; i < x.size(); ++i) mean += x[i];
+    mean /= x.size();
+    if (x.size() < 2) return;
+    for (unsigned i = 0; i < x.size(); ++i) var += (x[i] - mean) * (x[i] - mean);
+    var /= (x.size() - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Continued fraction for the incomplete beta function (Lentz's method).
+//
+double betaFraction(double a, double b, double x) {
+    const double tiny = 1e-300;
+    double c = 1, d = 1 - (a + b) * x / (a + 1);
+    if (std::fabs(d) < tiny) d = tiny;
+    d = 1 / d;
+    double h = d;
+    for (int m = 1; m <= 200; ++m) {
+        double m2 = 2 * m;
+        double aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+        d = 1 + aa * d;  if (std::fabs(d) < tiny) d = tiny;
+        c = 1 + aa / c;  if (std::fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        h *= d * c;
+        aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+        d = 1 + aa * d;  if (std::fabs(d) < tiny) d = tiny;
+        c = 1 + aa / c;  if (std::fabs(c) < tiny) c = tiny;
+        d = 1 / d;
+        double del = d * c;
+        h *= del;
+        if (std::fabs(del - 1) < 1e-12) break;
+    }
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Regularized incomplete beta function I_x(a, b).
+//
+double incompleteBeta(double a, double b, double x) {
+    if (x <= 0) return 0;
+    if (x >= 1) return 1;
+    double front = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) +
+                            a * std::log(x) + b * std::log(1 - x));
+    if (x < (a + 1) / (a + b + 2)) return front * betaFraction(a, b, x) / a;
+    return 1 - front * betaFraction(b, a, 1 - x) / b;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Two-sided p-value of Welch's t-test, or -1 if it cannot be computed:
+//  fewer than two runs on a side, or no variance on either.
+//
+double welch(const std::vector<double>& x, const std::vector<double>& y) {
+    if (x.size() < 2 || y.size() < 2) return -1;
+    double mx, vx, my, vy;
+    meanVar(x, mx, vx);
+    meanVar(y, my, vy);
+    double sx = vx / x.size(), sy = vy / y.size();
+    if (sx + sy == 0) return -1;
+    double t  = (mx - my) / std::sqrt(sx + sy);
+    double df = (sx + sy) * (sx + sy) /
+                (sx * sx / (x.size() - 1) + sy * sy / (y.size() - 1));
+    return incompleteBeta(df / 2, 0.5, df / (df + t * t));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A site's row in the output, with its rank key.
+//
+struct Delta {
+    const Site*  site;
+    double       base, cand, pvalue, impact;
+    bool         exact;         //Every run agrees on each side
+};
+
+bool byImpact(const Delta& a, const Delta& b) { return a.impact > b.impact; }
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads the reports named in files into sites.
+//  Returns false if a file cannot be opened.
+//
+bool readRuns(const std::vector<std::string>& files, bool isBase,
+              std::unordered_map<std::string, Site>& sites) {
+    for (unsigned i = 0; i < files.size(); ++i) {
+        std::ifstream in(files[i].c_str());
+        if (!in) {
+            std::cerr << "Error: Cannot open " << files[i] << std::endl;
+            return false;
+        }
+        addRun(readReports(in).rows, isBase, i, sites);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    std::vector<std::string> baseFiles, candFiles;
+    unsigned long top = 0;
+    bool cand = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-n" && i + 1 < argc) { top = atol(argv[++i]); continue; }
+        if (arg == "--") { cand = true; continue; }
+        (cand ? candFiles : baseFiles).push_back(arg);
+    }
+    if (baseFiles.size() == 0 || candFiles.size() == 0) {
+        std::cerr << "Error: Baseline and candidate profile outputs are required.";
+        std::cerr << std::endl << "profdiff [-n top] base1.out base2.out -- ";
+        std::cerr << "cand1.out cand2.out" << std::endl << std::endl;
+        return(1);
+    }
+
+    std::unordered_map<std::string, Site> sites;
+    if (!readRuns(baseFiles, true, sites) || !readRuns(candFiles, false, sites))
+        return(1);
+
+    // Fill in runs a site did not appear in, and total each metric
+    std::map<std::string, double> total;
+    std::vector<Delta> deltas;
+    for (std::unordered_map<std::string, Site>::iterator i = sites.begin(); i != sites.end(); ++i) {
+        Site& site = i->second;
+        site.base.resize(baseFiles.size(), 0);
+        site.cand.resize(candFiles.size(), 0);
+        Delta d;
+        double baseVar, candVar;
+        d.site = &site;
+        meanVar(site.base, d.base, baseVar);
+        meanVar(site.cand, d.cand, candVar);
+        d.exact  = site.base.size() > 1 && site.cand.size() > 1 && baseVar == 0 && candVar == 0;
+        d.pvalue = welch(site.base, site.cand);
+        total[site.metric] += std::max(d.base, d.cand);
+        deltas.push_back(d);
+    }
+    for (unsigned i = 0; i < deltas.size(); ++i) {
+        double t = total[deltas[i].site->metric];
+        deltas[i].impact = (t > 0) ? std::fabs(deltas[i].cand - deltas[i].base) / t : 0;
+    }
+
+    if (top == 0 || top > deltas.size()) top = deltas.size();
+    std::partial_sort(deltas.begin(), deltas.begin() + top, deltas.end(), byImpact);
+
+    std::cout << "file\tfunction\toffset\tsite\tmetric\tbase\tcand\tdelta\trelative\tp_value\timpact\n";
+    for (unsigned long i = 0; i < top; ++i) {
+        const Delta& d = deltas[i];
+        if (d.base == d.cand && d.impact == 0) break;
+        std::cout << d.site->file << '\t' << d.site->function << '\t' << d.site->offset << '\t'
+                  << (d.site->label == "" ? "statement" : d.site->label) << '\t'
+                  << d.site->metric << '\t' << d.base << '\t' << d.cand << '\t'
+                  << d.cand - d.base << '\t';
+        if (d.base != 0) std::cout << (d.cand - d.base) / d.base;
+        else             std::cout << "inf";
+        std::cout << '\t';
+        if (d.exact)           std::cout << "exact";
+        else if (d.pvalue < 0) std::cout << "NA";
+        else                   std::cout << d.pvalue;
+        std::cout << '\t' << d.impact << '\n';
+    }
+    return 0;
+}
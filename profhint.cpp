@@ -0,0 +1,309 @@
+////////////////////////////////////////////////////////////////////////////////
+//  profhint.cpp
+//  Profiler
+//
+//  Turns a profile into hints for the compiler.  Reads the reports in
+//   the output of a profiled run and the srcML the program was
+//   instrumented from, and writes a copy of each source with:
+//     [[gnu::hot]] on functions called often, and with -cold n,
+//       [[gnu::cold]] on those never called in any of n or more runs,
+//     [[likely]] or [[unlikely]] on if statements whose then part runs
+//       nearly always or nearly never (C++20; older compilers warn).
+//  Then lists the inlining candidates: functions called often, small
+//   by the tokens in their body, not declared inline, and called from
+//   other profiled functions that ran.
+//
+//  Report lines are mapped to the source by instrumenting the srcML
+//   again as the profiler does and locating each counter in the edit
+//   script, so the srcML must be the one the run was built from.
+//
+//  Usage: profhint [-hot fraction] [-bias fraction] [-min count] [-small tokens]
+//                  [-cold runs] profile.out ... file.cpp.xml ...
+//   Writes dir/h-file.cpp for each dir/file.cpp.xml.  Several outputs
+//   (runs) are summed.  No function is marked cold without -cold, nor
+//   with fewer outputs than it asks for: one run rarely covers every
+//   input a function is there for.
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+
+#include "ASTree.hpp"
+#include "report.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Counts of the reports by file, then by "line<tab>name".
+//
+typedef std::map<std::string, std::map<std::string, double> > Counts;
+
+////////////////////////////////////////////////////////////////////////////////
+// A function of the sources with its count.
+//
+struct Function {
+    std::string  file, output;
+    SourceSite   site;
+    double       calls;
+};
+
+bool byCalls(const Function& a, const Function& b) {
+    return a.calls > b.calls;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A source to write with its hints, and how many ifs were marked.
+//
+struct Annotated {
+    std::string        output, source;
+    std::vector<Edit>  hints;
+    int                likely, unlikely;
+};
+
+bool byOffset(const Edit& a, const Edit& b) {
+    return a.offset < b.offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Annotated source of a srcML file: dir/foo.cpp.xml => dir/h-foo.cpp
+//
+std::string hintNameOf(const std::string& filename) {
+    std::string::size_type slash = filename.rfind('/') + 1;
+    std::string result = filename.substr(0, slash) + "h-" + filename.substr(slash);
+    return result.substr(0, result.find(".xml"));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Maps offsets of the source and of the edit script inserting the
+//  counters to the lines __LINE__ has in the instrumented file.
+//
+class LineMap {
+public:
+    LineMap(const std::string& source, const std::vector<Edit>& edits) : script(edits) {
+        for (std::size_t i = 0; i < source.size(); ++i) {
+            if (source[i] == '\n') breaks.push_back(i);
+        }
+        int inserted = 0;
+        for (unsigned long i = 0; i < script.size(); ++i) {
+            before.push_back(inserted);
+            inserted += std::count(script[i].text.begin(), script[i].text.end(), '\n');
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////
+    // Line of the first marker inserted at an offset in [from, to], or 0.
+    //  A marker followed by notBefore, if it is given, does not count.
+    //
+    int find(std::size_t from, std::size_t to, const std::string& marker,
+             const std::string& notBefore = "") const {
+        for (unsigned long i = 0; i < script.size(); ++i) {
+            if (script[i].offset < from) continue;
+            if (script[i].offset > to) break;
+            std::string::size_type at = script[i].text.find(marker);
+            while (at != std::string::npos && notBefore != "" &&
+                   script[i].text.compare(at + marker.size(), notBefore.size(), notBefore) == 0)
+                at = script[i].text.find(marker, at + 1);
+            if (at == std::string::npos) continue;
+            int source = std::lower_bound(breaks.begin(), breaks.end(), script[i].offset) - breaks.begin();
+            return 1 + source + before[i] +
+                   std::count(script[i].text.begin(), script[i].text.begin() + at, '\n');
+        }
+        return 0;
+    }
+
+private:
+    const std::vector<Edit>&  script;
+    std::vector<std::size_t>  breaks;       //Offsets of the source's line breaks
+    std::vector<int>          before;       //Line breaks inserted before each edit
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Count of a report row, or -1 if there is none.
+//
+double countOf(const std::map<std::string, double>& rows, int line, const std::string& name) {
+    std::ostringstream key;
+    key << line << '\t' << name;
+    std::map<std::string, double>::const_iterator i = rows.find(key.str());
+    return (i == rows.end()) ? -1 : i->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    double hot   = 0.01;            //Fraction of all calls
+    double bias  = 0.9;             //Fraction of executions of an if
+    double least = 100;             //Executions before an if is judged
+    int    small = 40;              //Tokens in the body
+    unsigned coldRuns = 0;          //Runs before an uncalled function is cold, 0 never
+    std::vector<std::string> outputs, sources;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if      (arg == "-hot"   && i + 1 < argc) hot   = atof(argv[++i]);
+        else if (arg == "-bias"  && i + 1 < argc) bias  = atof(argv[++i]);
+        else if (arg == "-min"   && i + 1 < argc) least = atof(argv[++i]);
+        else if (arg == "-small" && i + 1 < argc) small = atoi(argv[++i]);
+        else if (arg == "-cold"  && i + 1 < argc) coldRuns = atoi(argv[++i]);
+        else if (arg.size() > 4 && arg.compare(arg.size() - 4, 4, ".xml") == 0) sources.push_back(arg);
+        else if (arg[0] != '-') outputs.push_back(arg);
+        else {
+            outputs.clear();
+            break;
+        }
+    }
+    if (outputs.empty() || sources.empty()) {
+        std::cerr << "Error: Need profile outputs and srcML files." << std::endl;
+        std::cerr << "profhint [-hot fraction] [-bias fraction] [-min count] [-small tokens]" << std::endl
+                  << "         [-cold runs] profile.out ... file.cpp.xml ..." << std::endl << std::endl;
+        return(1);
+    }
+
+    Counts counts;
+    std::vector<std::string> reported;              //Files in report order
+    for (unsigned i = 0; i < outputs.size(); ++i) {
+        std::ifstream in(outputs[i].c_str());
+        if (!in) {
+            std::cerr << "Error: Cannot open " << outputs[i] << std::endl;
+            return(1);
+        }
+        Reports reports = readReports(in);
+        for (unsigned j = 0; j < reports.files.size(); ++j) counts[reports.files[j]];
+        for (unsigned j = 0; j < reports.rows.size(); ++j) {
+            const ReportRow& row = reports.rows[j];
+            std::ostringstream key;
+            key << row.line << '\t' << row.name;
+            counts[row.file][key.str()] += row.count;
+        }
+        if (i == 0) reported = reports.files;
+    }
+    std::vector<std::string> profileName;           //As main was instrumented
+    for (unsigned i = 0; i < reported.size(); ++i) profileName.push_back(profileNameOf(reported[i]));
+
+    std::vector<Function>  functions;
+    std::vector<Annotated> annotated;
+    double totalCalls = 0;
+    for (unsigned f = 0; f < sources.size(); ++f) {
+        std::ifstream inFile(sources[f].c_str());
+        if (!inFile) {
+            std::cerr << "Error: Cannot open " << sources[f] << std::endl;
+            return(1);
+        }
+        srcML code;
+        inFile >> code;
+        srcML instrumented(code);
+        std::vector<SourceSite> sites;
+        code.sites(sites);
+
+        std::string name = profileNameOf(sources[f]);
+        std::string file = reportNameOf(name);
+        if (counts.count(file) == 0) {
+            std::cerr << "Warning: No report for " << file << ", not annotated." << std::endl;
+            continue;
+        }
+        bool isMain = false;
+        for (unsigned i = 0; i < sites.size(); ++i) {
+            if (sites[i].kind == "function" && sites[i].name == "main") isMain = true;
+        }
+        if (isMain) {
+            instrumented.mainHeader(profileName);
+            instrumented.mainReport(profileName);
+        } else {
+            instrumented.fileHeader(name);
+        }
+        instrumented.funcCount(name);
+        instrumented.lineCount(name);
+        std::vector<Edit> script;
+        instrumented.editScript(script);
+        LineMap lines(code.text(), script);
+        const std::map<std::string, double>& rows = counts[file];
+
+        for (unsigned i = 0; i < sites.size(); ++i) {
+            const SourceSite& site = sites[i];
+            if (site.kind != "function" && site.kind != "constructor" && site.kind != "destructor") continue;
+            int line = lines.find(site.counter, site.counter, "profile_call_(");
+            Function func;
+            func.file   = file;
+            func.output = hintNameOf(sources[f]);
+            func.site  = site;
+            func.calls = std::max(0.0, countOf(rows, line, site.name));
+            totalCalls += func.calls;
+            functions.push_back(func);
+        }
+
+        // Branches of the ifs run often enough to judge
+        std::vector<Edit> hints;
+        int likely = 0, unlikely = 0;
+        for (unsigned i = 0; i < sites.size(); ++i) {
+            const SourceSite& site = sites[i];
+            if (site.kind != "if" || site.first == 0) continue;
+            double runs = countOf(rows, lines.find(site.counter, site.counterEnd, "\"if condition\""), "if condition");
+            if (runs < least) continue;
+            int line = lines.find(site.first, site.end, ".count(__LINE__, ", "\"");   //Not a condition
+            int run  = lines.find(site.first, site.end, ".block(__LINE__");
+            if (line == 0 || (run != 0 && run < line)) line = run;
+            if (line == 0) continue;
+            double taken = std::max(0.0, countOf(rows, line, ""));    //Rows of 0 are left out
+            if (taken >= bias * runs) {
+                hints.push_back(Edit{site.attribute, " [[likely]]"});
+                ++likely;
+            } else if (taken <= (1 - bias) * runs) {
+                hints.push_back(Edit{site.attribute, " [[unlikely]]"});
+                ++unlikely;
+            }
+        }
+
+        Annotated result;
+        result.output   = hintNameOf(sources[f]);
+        result.source   = code.text();
+        result.hints    = hints;
+        result.likely   = likely;
+        result.unlikely = unlikely;
+        annotated.push_back(result);
+    }
+
+    // Functions are judged once every file is read
+    bool markCold = coldRuns > 0 && outputs.size() >= coldRuns;
+    if (coldRuns > 0 && !markCold)
+        std::cerr << "Warning: " << outputs.size() << " of " << coldRuns
+                  << " runs for -cold, no function marked cold." << std::endl;
+    for (unsigned k = 0; k < annotated.size(); ++k) {
+        Annotated& result = annotated[k];
+        int hotCount = 0, coldCount = 0;
+        for (unsigned i = 0; i < functions.size(); ++i) {
+            if (functions[i].output != result.output) continue;
+            if (functions[i].calls == 0) {
+                if (!markCold) continue;
+                result.hints.push_back(Edit{functions[i].site.attribute, "[[gnu::cold]] "});
+                ++coldCount;
+            } else if (functions[i].calls >= hot * totalCalls) {
+                result.hints.push_back(Edit{functions[i].site.attribute, "[[gnu::hot]] "});
+                ++hotCount;
+            }
+        }
+        std::stable_sort(result.hints.begin(), result.hints.end(), byOffset);
+        std::ofstream out(result.output.c_str());
+        patch(out, result.source, result.hints);
+        std::cout << result.output << "\thot " << hotCount << "\tcold " << coldCount
+                  << "\tlikely " << result.likely << "\tunlikely " << result.unlikely << std::endl;
+    }
+
+    // Small hot functions called from other profiled functions that ran
+    std::sort(functions.begin(), functions.end(), byCalls);
+    std::cout << std::endl << "Inlining candidates\tfile\tcalls\ttokens\tcalled from" << std::endl;
+    for (unsigned i = 0; i < functions.size(); ++i) {
+        const Function& func = functions[i];
+        if (func.calls < hot * totalCalls || func.site.tokens > small || func.site.isInline) continue;
+        std::string callers;
+        for (unsigned j = 0; j < functions.size(); ++j) {
+            if (j == i || functions[j].calls == 0 || functions[j].site.calls.count(func.site.name) == 0) continue;
+            callers += (callers == "" ? "" : " ") + functions[j].site.name;
+        }
+        if (callers == "") continue;
+        std::cout << func.site.name << "\t" << func.file << "\t" << func.calls << "\t"
+                  << func.site.tokens << "\t" << callers << std::endl;
+    }
+    return 0;
+}
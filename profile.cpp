@@ -9,26 +9,1118 @@
  */
 
 #include "profile.hpp"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <ctime>
+#include <new>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include "profile_shm.hpp"
+#include "profile_symbol.hpp"
+
 
 ////////////////////////////////////////////////////////////////////////
-// Prints out the profile.
+// Tracing
 //
-// TODO: Very simple output, need to make it into columns with nice headings.
-// 
-std::ostream& operator<< (std::ostream& out, const profile& p) {
-    
-    out << std::endl << "File: " << p.fname << std::endl;
+// Each thread writes 16 byte events into its own ring buffer.  Only
+//  the thread moves head and only the drainer moves tail, so no locks
+//  are taken on the hot path.  A full buffer drops whole calls, entry
+//  and exit, and counts the drops.  A background thread drains the
+//  buffers into the file named by PROFILE_TRACE.  trace2json converts
+//  the file for chrome://tracing.
+//
+// File format (host byte order):
+//  "PTRC1\n"
+//  'N' u64 id  u32 length  name          first use of a function name
+//  'E' u32 tid u32 n       n x (u64 time, u64 id)
+//  'D' u32 tid u64 dropped               written at the end
+//  Time is ns from the start of the trace; the top bit marks an exit.
+//
+
+struct TraceEvent {
+    uint64_t     time;                      // Top bit set on exit.
+    const char*  name;
+};
+
+struct TraceBuffer {
+    static const uint64_t  size = 1 << 16;  // Power of 2.
+    TraceEvent             event[size];
+    std::atomic<uint64_t>  head;            // Written by the owning thread.
+    std::atomic<uint64_t>  tail;            // Written by the drainer.
+    std::atomic<uint64_t>  dropped;
+    std::atomic<bool>      finished;        // Owning thread has exited.
+    uint32_t               tid;
+};
+
+////////////////////////////////////////////////////////////////////////
+// The drainer thread and the list of thread buffers.
+//
+class Tracer {
+public:
+                 Tracer  ();
+                 ~Tracer ();
+    bool         start   (const char*);
+    TraceBuffer* attach  ();
+    uint64_t     now     () const;
+
+private:
+    void         run     ();
+    bool         drain   ();
+    void         write   (const void* p, std::size_t n) { out.write(static_cast<const char*>(p), n); }
+
+    std::ofstream               out;
+    std::thread                 drainer;
+    std::atomic<bool>           stopping;
+    std::mutex                  lock;       // Guards buffers and nextTid.
+    std::vector<TraceBuffer*>   buffers;
+    std::set<const char*>       named;      // Names already written.
+    std::vector<TraceEvent>     batch;
+    uint32_t                    nextTid;
+    std::chrono::steady_clock::time_point epoch;
+};
+
+Tracer tracer;
+
+bool profile_runtime::tracing = tracer.start(std::getenv("PROFILE_TRACE"));
+
+////////////////////////////////////////////////////////////////////////
+// Starts tracing for the trace policy on its first call, to the file
+//  named by PROFILE_TRACE or else profile.trace.  Returns true if
+//  tracing is on.
+//
+bool profile_runtime::startTracing() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        const char* filename = std::getenv("PROFILE_TRACE");
+        if (!tracing) tracing = tracer.start(filename && *filename ? filename : "profile.trace");
+    });
+    return tracing;
+}
+
+////////////////////////////////////////////////////////////////////////
+// The calling thread's buffer and call depth.  Marks the buffer finished
+//  when the thread exits; the drainer may then free it, so the thread
+//  traces nothing more (traceEnded outlives the holder).
+//
+thread_local bool traceEnded = false;
+
+struct TraceHolder {
+    TraceBuffer* buffer;
+    uint64_t     depth;                     // Calls entered and not exited.
+    uint64_t     dropFrom;                  // Depth of the first dropped entry, or 0.
+                 TraceHolder () : buffer(0), depth(0), dropFrom(0) {}
+                 ~TraceHolder() {
+                     if (buffer) buffer->finished = true;
+                     buffer = 0;
+                     traceEnded = true;
+                 }
+};
+
+thread_local TraceHolder traceHolder;
+
+Tracer::Tracer() : stopping(false), nextTid(1), epoch(std::chrono::steady_clock::now()) {
+}
+
+////////////////////////////////////////////////////////////////////////
+// Opens the trace file and starts the drainer.
+//  Returns true if tracing is on.
+//
+bool Tracer::start(const char* filename) {
+    if (filename == 0 || *filename == 0) return false;
+    out.open(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "profile: cannot open trace file " << filename << std::endl;
+        return false;
+    }
+    write("PTRC1\n", 6);
+    drainer = std::thread(&Tracer::run, this);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Stops tracing, drains what is left and records drops.
+//
+Tracer::~Tracer() {
+    if (!drainer.joinable()) return;
+    profile_runtime::tracing = false;
+    stopping = true;
+    drainer.join();
+    drain();
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        uint64_t dropped = buffers[i]->dropped;
+        write("D", 1);
+        write(&buffers[i]->tid, 4);
+        write(&dropped, 8);
+        if (dropped) std::cerr << "profile: thread " << buffers[i]->tid << " dropped "
+                               << dropped << " trace events" << std::endl;
+    }
+    out.close();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Registers a ring buffer for the calling thread.
+//
+TraceBuffer* Tracer::attach() {
+    TraceBuffer* result = new TraceBuffer;
+    result->head = 0;
+    result->tail = 0;
+    result->dropped = 0;
+    result->finished = false;
+    std::lock_guard<std::mutex> guard(lock);
+    result->tid = nextTid++;
+    buffers.push_back(result);
+    return result;
+}
+
+uint64_t Tracer::now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch).count();
+}
+
+void Tracer::run() {
+    while (!stopping) {
+        if (!drain()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Writes every buffered event.  Buffers of exited threads are freed
+//  once empty.  Returns true if any event was written.
+//
+bool Tracer::drain() {
+    bool wrote = false;
+    std::lock_guard<std::mutex> guard(lock);
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+        TraceBuffer* buf = buffers[i];
+        bool     finished = buf->finished;
+        uint64_t tail = buf->tail.load(std::memory_order_relaxed);
+        uint64_t head = buf->head.load(std::memory_order_acquire);
+        if (head != tail) {
+            batch.clear();
+            for (uint64_t j = tail; j != head; ++j) {
+                const TraceEvent& e = buf->event[j & (TraceBuffer::size - 1)];
+                batch.push_back(e);
+                if (named.insert(e.name).second) {
+                    uint64_t id = reinterpret_cast<uintptr_t>(e.name);
+                    uint32_t n = static_cast<uint32_t>(std::string(e.name).size());
+                    write("N", 1); write(&id, 8); write(&n, 4); write(e.name, n);
+                }
+            }
+            buf->tail.store(head, std::memory_order_release);
+            uint32_t n = static_cast<uint32_t>(batch.size());
+            write("E", 1); write(&buf->tid, 4); write(&n, 4);
+            for (std::size_t j = 0; j < batch.size(); ++j) {
+                uint64_t id = reinterpret_cast<uintptr_t>(batch[j].name);
+                write(&batch[j].time, 8); write(&id, 8);
+            }
+            wrote = true;
+        }
+        if (finished && head == buf->head.load(std::memory_order_acquire) && !stopping) {
+            uint64_t dropped = buf->dropped;
+            write("D", 1); write(&buf->tid, 4); write(&dropped, 8);
+            delete buf;
+            buffers.erase(buffers.begin() + i);
+            --i;
+        }
+    }
+    return wrote;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Records entry to (exit false) or exit from (exit true) the function
+//  name in the calling thread's buffer.  An entry is kept only if there
+//  is room for it and for the exits of every open call, so a kept entry
+//  always gets its exit.  Once an entry is dropped, the calls within it
+//  are dropped too, up to its exit.
+//
+void profile_runtime::trace(const char* name, bool exit) {
+    TraceHolder& holder = traceHolder;
+    TraceBuffer* buf = holder.buffer;
+    if (buf == 0) {
+        if (traceEnded) return;
+        buf = holder.buffer = tracer.attach();
+    }
+    bool keep;
+    if (exit) {
+        if (holder.depth == 0) return;      // Entered before tracing started.
+        keep = holder.dropFrom == 0;
+        if (holder.dropFrom == holder.depth) holder.dropFrom = 0;
+        --holder.depth;
+    } else {
+        ++holder.depth;
+        uint64_t head = buf->head.load(std::memory_order_relaxed);
+        uint64_t used = head - buf->tail.load(std::memory_order_acquire);
+        keep = holder.dropFrom == 0 && TraceBuffer::size - used > holder.depth;
+        if (!keep && holder.dropFrom == 0) holder.dropFrom = holder.depth;
+    }
+    if (!keep) {
+        buf->dropped.store(buf->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    uint64_t head = buf->head.load(std::memory_order_relaxed);
+    TraceEvent& e = buf->event[head & (TraceBuffer::size - 1)];
+    e.time = tracer.now() | (uint64_t(exit) << 63);
+    e.name = name;
+    buf->head.store(head + 1, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Live counters
+//
+// With PROFILE_SHM set every counter lives in a shared-memory segment,
+//  /profile.<pid>, laid out as in profile_shm.hpp, so proftop can watch
+//  a running process.  A site is added the first time it is counted.
+//  PROFILE_SHM=keep leaves the segment behind when the process exits.
+//  A forked child moves to its own segment with the counts at zero.
+//  If the segment fills up, further sites are counted privately.
+//
+
+class ShmSegment {
+public:
+                  ShmSegment () : header(0), sites(0), bytes(0), keep(false) {}
+                  ~ShmSegment();
+    bool          start      (const char*);
+    int           addSite    (const std::string&, int, const std::string&, const char*);
+    std::atomic<uint64_t>& counter(int site)        { return sites[site].count; }
+
+private:
+    bool          create     (const ProfileShmHeader*);
+    static void   forked     ();
+
+    ProfileShmHeader*  header;
+    ProfileShmSite*    sites;
+    std::size_t        bytes;
+    std::string        name;
+    bool               keep;
+    std::mutex         lock;        // Guards adding sites.
+};
+
+ShmSegment segment;
+std::mutex liveLock;                // Guards liveStmt and liveBlocks of every profile.
+
+bool profile_runtime::live = segment.start(std::getenv("PROFILE_SHM"));
+
+////////////////////////////////////////////////////////////////////////
+// Creates and maps the segment for this process.
+//  Copies the sites of from (with zero counts) if it is not 0.
+//
+bool ShmSegment::create(const ProfileShmHeader* from) {
+    const uint32_t capacity = 1 << 16;
+    name  = "/profile." + intToString(getpid());
+    bytes = sizeof(ProfileShmHeader) + capacity * sizeof(ProfileShmSite);
+
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    if (ftruncate(fd, bytes) != 0) { close(fd); shm_unlink(name.c_str()); return false; }
+    void* base = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { shm_unlink(name.c_str()); return false; }
+
+    header = new (base) ProfileShmHeader;
+    sites  = reinterpret_cast<ProfileShmSite*>(header + 1);
+    std::memcpy(header->magic, PROFILE_SHM_MAGIC, sizeof(header->magic));
+    header->version    = PROFILE_SHM_VERSION;
+    header->headerSize = sizeof(ProfileShmHeader);
+    header->siteSize   = sizeof(ProfileShmSite);
+    header->capacity   = capacity;
+    header->pid        = getpid();
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->startNs    = uint64_t(now.tv_sec) * 1000000000u + now.tv_nsec;
+    std::memset(header->program, 0, sizeof(header->program));
+    std::ifstream comm("/proc/self/comm");
+    comm.getline(header->program, sizeof(header->program) - 1);
+
+    uint32_t used = from ? from->used.load() : 0;
+    if (from) {
+        const ProfileShmSite* old = reinterpret_cast<const ProfileShmSite*>(from + 1);
+        for (uint32_t i = 0; i < used; ++i) {
+            new (&sites[i]) ProfileShmSite;
+            sites[i].count = 0;
+            sites[i].line  = old[i].line;
+            std::memcpy(sites[i].file,  old[i].file,  sizeof(sites[i].file));
+            std::memcpy(sites[i].name,  old[i].name,  sizeof(sites[i].name));
+            std::memcpy(sites[i].above, old[i].above, sizeof(sites[i].above));
+        }
+    }
+    header->used.store(used, std::memory_order_release);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Turns live counters on if value is set.  Returns true if they are.
+//
+bool ShmSegment::start(const char* value) {
+    if (value == 0 || *value == 0) return false;
+    keep = std::string(value) == "keep";
+    if (!create(0)) {
+        std::cerr << "profile: cannot create shared memory for PROFILE_SHM" << std::endl;
+        return false;
+    }
+    pthread_atfork(0, 0, &ShmSegment::forked);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// In a forked child: move to a segment of its own.
+//
+void ShmSegment::forked() {
+    ProfileShmHeader* old = segment.header;
+    std::size_t oldBytes = segment.bytes;
+    new (&segment.lock) std::mutex;                 //May have been held at fork
+    new (&liveLock) std::mutex;
+    if (!segment.create(old)) {
+        std::cerr << "profile: cannot create shared memory in child" << std::endl;
+        profile_runtime::live = false;
+    }
+    munmap(old, oldBytes);
+}
+
+ShmSegment::~ShmSegment() {
+    if (header == 0) return;
+    if (!keep) shm_unlink(name.c_str());
+}
+
+////////////////////////////////////////////////////////////////////////
+// Publishes a site.  Returns its index, or -1 if the segment is full.
+//
+int ShmSegment::addSite(const std::string& file, int line, const std::string& siteName, const char* above) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint32_t used = header->used.load(std::memory_order_relaxed);
+    if (used == header->capacity) return -1;
+    ProfileShmSite* site = new (&sites[used]) ProfileShmSite;
+    site->count = 0;
+    site->line  = line;
+    std::strncpy(site->file,  file.c_str(),     sizeof(site->file) - 1);
+    std::strncpy(site->name,  siteName.c_str(), sizeof(site->name) - 1);
+    std::strncpy(site->above, above,            sizeof(site->above) - 1);
+    header->used.store(used + 1, std::memory_order_release);
+    return static_cast<int>(used);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Bumps a shared counter.  Any thread of the program may count the same
+//  site, so the add is atomic.  proftop only reads it.
+//
+inline void bump(std::atomic<uint64_t>& counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Counts a line or function in the shared segment.
+//
+void profile_runtime::liveCount(int line, const std::string& funcName) {
+    std::string key = (funcName == "") ? intToString(line) : intToString(line) + " " + funcName;
+    std::lock_guard<std::mutex> guard(liveLock);
+    std::map<std::string, int>::iterator i = liveStmt.find(key);
+    if (i == liveStmt.end())
+        i = liveStmt.insert(std::make_pair(key, segment.addSite(fname, line, funcName, ""))).first;
+    if (i->second < 0) { std::lock_guard<std::mutex> full(profile_runtime::counting); stmt[key] += 1; }
+    else               bump(segment.counter(i->second));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Counts a basic block in the shared segment.
+//
+void profile_runtime::liveBlock(int line, const char* above) {
+    std::pair<int, const char*> key(line, above);
+    std::lock_guard<std::mutex> guard(liveLock);
+    std::map<std::pair<int, const char*>, int>::iterator i = liveBlocks.find(key);
+    if (i == liveBlocks.end())
+        i = liveBlocks.insert(std::make_pair(key, segment.addSite(fname, line, "", above))).first;
+    if (i->second < 0) { std::lock_guard<std::mutex> full(profile_runtime::counting); blocks[key] += 1; }
+    else               bump(segment.counter(i->second));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Adds the shared counts of this profile to stmt and blocks.
+//
+void profile_runtime::gather(std::map<std::string, uint64_t>& stmtOut,
+                     std::map<std::pair<int, const char*>, uint64_t>& blocksOut) const {
+    std::lock_guard<std::mutex> guard(liveLock);
+    for (std::map<std::string, int>::const_iterator i = liveStmt.begin(); i != liveStmt.end(); ++i) {
+        uint64_t n = (i->second >= 0) ? segment.counter(i->second).load() : 0;
+        if (n > 0) stmtOut[i->first] += n;
+    }
+    typedef std::map<std::pair<int, const char*>, int>::const_iterator Block;
+    for (Block i = liveBlocks.begin(); i != liveBlocks.end(); ++i) {
+        uint64_t n = (i->second >= 0) ? segment.counter(i->second).load() : 0;
+        if (n > 0) blocksOut[i->first] += n;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Adaptive counters
+//
+// With PROFILE_ADAPTIVE set, each site is counted exactly for its first
+//  threshold hits and is then sampled: a random one hit in about period
+//  is recorded and stands for period hits.  period starts at 2 and
+//  doubles each time the estimate doubles, so a hot site costs little
+//  more than a decrement per hit while its relative error shrinks.
+//  The report gives a sampled count with "(+-bound)", about two
+//  standard deviations.
+//
+//  PROFILE_ADAPTIVE=threshold[,site=threshold...]
+//   A site is a function name, a line, or file:line (sort_lib.cpp:54).
+//
+
+std::map<std::string, uint64_t> adaptiveThreshold;     // Site => threshold, "" the default
+
+////////////////////////////////////////////////////////////////////////
+// Reads the thresholds.  Returns true if adaptive counting is on.
+//
+bool startAdaptive(const char* value) {
+    adaptiveThreshold[""] = 1000000;        // Also for the sample policy
+    if (value == 0 || *value == 0) return false;
+    std::istringstream in(value);
+    std::string field;
+    while (std::getline(in, field, ',')) {
+        std::string::size_type equal = field.rfind('=');
+        std::string name = (equal == std::string::npos) ? "" : field.substr(0, equal);
+        uint64_t threshold = std::strtoull(field.c_str() + (equal == std::string::npos ? 0 : equal + 1), 0, 10);
+        adaptiveThreshold[name] = std::max<uint64_t>(threshold, 1);
+    }
+    return true;
+}
+
+bool profile_runtime::adaptive = startAdaptive(std::getenv("PROFILE_ADAPTIVE"));
+
+////////////////////////////////////////////////////////////////////////
+// Starts a site of file fname at line named name (0 for none).
+//
+void profile_runtime::newSite(Site& s, int line, const char* name) {
+    std::map<std::string, uint64_t>::const_iterator i = adaptiveThreshold.end();
+    if (name) i = adaptiveThreshold.find(name);
+    if (i == adaptiveThreshold.end()) i = adaptiveThreshold.find(fname + ":" + intToString(line));
+    if (i == adaptiveThreshold.end()) i = adaptiveThreshold.find(intToString(line));
+    if (i == adaptiveThreshold.end()) i = adaptiveThreshold.find("");
+    s.threshold = i->second;
+    s.countdown = static_cast<int64_t>(s.threshold);
+    s.period    = 1;
+    s.estimate  = 0;
+    s.variance  = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Finds or makes the site for a slot that missed, and caches it there.
+//
+profile_runtime::Site& profile_runtime::fill(Slot& slot, int kind, int line, const void* key) {
+    const char* text = static_cast<const char*>(key);
+    Site* result;
+    if (kind == 2) {
+        std::pair<int, const char*> k(line, text);
+        std::map<std::pair<int, const char*>, Site>::iterator i = sampledBlocks.find(k);
+        if (i == sampledBlocks.end()) {
+            i = sampledBlocks.insert(std::make_pair(k, Site())).first;
+            newSite(i->second, line, 0);
+        }
+        result = &i->second;
+    } else {
+        result = &site(kind == 0 ? intToString(line) : intToString(line) + " " + text,
+                       line, kind == 0 ? 0 : text);
+    }
+    slot.kind = kind;
+    slot.line = line;
+    slot.key  = key;
+    slot.site = result;
+    return *result;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Finds or makes the site with a key as in stmt.
+//
+profile_runtime::Site& profile_runtime::site(const std::string& key, int line, const char* name) {
+    std::map<std::string, Site>::iterator i = sampledStmt.find(key);
+    if (i == sampledStmt.end()) {
+        i = sampledStmt.insert(std::make_pair(key, Site())).first;
+        newSite(i->second, line, name);
+    }
+    return i->second;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Hits until the next sample: geometric with mean period.
+//
+int64_t nextSample(uint64_t period) {
+    static thread_local uint64_t state = 0x9E3779B97F4A7C15ULL ^ reinterpret_cast<uintptr_t>(&state);
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    double u = ((state >> 11) + 1) * (1.0 / 9007199254740993.0);       // (0, 1]
+    return 1 + static_cast<int64_t>(std::log(u) / std::log(1 - 1.0 / period));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Called when a site's countdown runs out: at the end of its exact
+//  hits, or on a sample.
+//
+void profile_runtime::record(Site& s) {
+    if (s.period == 1) {
+        s.estimate = static_cast<double>(s.threshold);
+        s.period   = 2;
+    } else {
+        s.estimate += s.period;
+        s.variance += double(s.period) * (s.period - 1);
+        if (s.estimate >= double(s.threshold) * s.period && s.period < (uint64_t(1) << 20))
+            s.period *= 2;
+    }
+    s.countdown = nextSample(s.period);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Adds the adaptive counts of this profile to stmt, spreading blocks
+//  over their lines, and the variance of each sampled one to variance.
+//
+void profile_runtime::gatherSampled(std::map<std::string, uint64_t>& stmtOut,
+                            std::map<std::string, double>& variance) const {
+    for (std::map<std::string, Site>::const_iterator i = sampledStmt.begin(); i != sampledStmt.end(); ++i) {
+        const Site& s = i->second;
+        double n = (s.period == 1) ? double(s.threshold - s.countdown) : s.estimate;
+        if (n > 0) stmtOut[i->first] += static_cast<uint64_t>(std::llround(n));
+        if (s.period > 1) variance[i->first] += s.variance;
+    }
+    typedef std::map<std::pair<int, const char*>, Site>::const_iterator Block;
+    for (Block i = sampledBlocks.begin(); i != sampledBlocks.end(); ++i) {
+        const Site& s = i->second;
+        double n = (s.period == 1) ? double(s.threshold - s.countdown) : s.estimate;
+        std::vector<int> lines(1, i->first.first);
+        std::istringstream above(i->first.second);
+        int offset;
+        while (above >> offset) lines.push_back(i->first.first - offset);
+        for (std::size_t j = 0; j < lines.size(); ++j) {
+            if (n > 0) stmtOut[intToString(lines[j])] += static_cast<uint64_t>(std::llround(n));
+            if (s.period > 1) variance[intToString(lines[j])] += s.variance;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Latency histograms
+//
+// With PROFILE_LATENCY set, profile::call times each call and adds it
+//  to a histogram of its function in the calling thread.  Histograms
+//  are log-linear (as in HdrHistogram): exact below 32 ticks, then 16
+//  buckets per power of two, so a value is kept to within 1/16.  Each
+//  thread has a fixed table of them, made on its first call; recording
+//  takes no lock and does not allocate.  The report merges the threads.
+//
+
+struct LatencyHistogram {
+    static const int  subBits = 4, sub = 1 << subBits;
+    static const int  buckets = (64 - subBits + 1) * sub;
+    uint64_t          count[buckets];
+    uint64_t          max, calls;
+
+    static int index(uint64_t v) {
+        if (v < 2 * uint64_t(sub)) return static_cast<int>(v);
+        int shift = 63 - __builtin_clzll(v) - subBits;
+        return (shift + 1) * sub + static_cast<int>((v >> shift) - sub);
+    }
+    static uint64_t highest(int i) {          // Largest value in bucket i
+        if (i < 2 * sub) return i;
+        int shift = i / sub - 1;
+        return ((uint64_t(sub + i % sub) << shift) + (uint64_t(1) << shift)) - 1;
+    }
+};
+
+struct LatencyTable {
+    static const int  size = 512;             // Functions per thread, power of 2.
+    struct Entry {
+        const profile_runtime* owner;
+        const char*            name;
+        LatencyHistogram*      histogram;
+    }                 entry[size];
+    uint64_t          dropped;                // Calls of functions that did not fit.
+};
+
+std::mutex                  latencyLock;      // Guards latencyTables.
+std::vector<LatencyTable*>  latencyTables;
+thread_local LatencyTable*  threadLatency = 0;
+
+uint64_t startTicks = profile_runtime::ticks();
+std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+bool profile_runtime::timing = std::getenv("PROFILE_LATENCY") && *std::getenv("PROFILE_LATENCY");
+
+////////////////////////////////////////////////////////////////////////
+// Adds a call of name in owner that took ticks to the thread's table.
+//
+void profile_runtime::latency(const profile_runtime& owner, const char* name, uint64_t elapsed) {
+    LatencyTable* table = threadLatency;
+    if (table == 0) {
+        table = threadLatency = new LatencyTable();
+        std::lock_guard<std::mutex> guard(latencyLock);
+        latencyTables.push_back(table);
+    }
+    uintptr_t h = (reinterpret_cast<uintptr_t>(name) >> 3) ^ (reinterpret_cast<uintptr_t>(&owner) >> 4);
+    for (int probe = 0; probe < LatencyTable::size; ++probe) {
+        LatencyTable::Entry& e = table->entry[(h + probe) & (LatencyTable::size - 1)];
+        if (e.name == 0) {                    // First call in this thread
+            e.histogram = new LatencyHistogram();
+            e.owner = &owner;
+            e.name  = name;
+        }
+        if (e.name == name && e.owner == &owner) {
+            LatencyHistogram& hist = *e.histogram;
+            ++hist.count[LatencyHistogram::index(elapsed)];
+            ++hist.calls;
+            if (elapsed > hist.max) hist.max = elapsed;
+            return;
+        }
+    }
+    ++table->dropped;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Nanoseconds per tick, measured against the steady clock since start.
+//
+double nsPerTick() {
+#if defined(__x86_64__) || defined(__i386__)
+    while (std::chrono::steady_clock::now() - startTime < std::chrono::milliseconds(10)) {}
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count();
+    return ns / (profile_runtime::ticks() - startTicks);
+#else
+    return 1;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////
+// Prints p50, p90, p99, p99.9 and max of each function of this profile,
+//  merged over all threads, in ns.
+//
+void profile_runtime::latencyReport(std::ostream& out) const {
+    std::map<std::string, LatencyHistogram> merged;
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> guard(latencyLock);
+        for (std::size_t t = 0; t < latencyTables.size(); ++t) {
+            dropped += latencyTables[t]->dropped;
+            for (int i = 0; i < LatencyTable::size; ++i) {
+                const LatencyTable::Entry& e = latencyTables[t]->entry[i];
+                if (e.owner != this) continue;
+                std::map<std::string, LatencyHistogram>::iterator m = merged.find(e.name);
+                if (m == merged.end()) {
+                    m = merged.insert(std::make_pair(std::string(e.name), LatencyHistogram())).first;
+                    std::memset(&m->second, 0, sizeof(LatencyHistogram));
+                }
+                for (int b = 0; b < LatencyHistogram::buckets; ++b) m->second.count[b] += e.histogram->count[b];
+                m->second.calls += e.histogram->calls;
+                m->second.max = std::max(m->second.max, e.histogram->max);
+            }
+        }
+    }
+    if (merged.empty()) return;
+
+    const double quantile[] = {0.5, 0.9, 0.99, 0.999};
+    double scale = nsPerTick();
+    out << std::endl << "Function latency (ns)\tcalls\tp50\tp90\tp99\tp99.9\tmax" << std::endl;
+    for (std::map<std::string, LatencyHistogram>::const_iterator i = merged.begin(); i != merged.end(); ++i) {
+        const LatencyHistogram& h = i->second;
+        out << i->first << "\t" << h.calls;
+        int b = 0;
+        uint64_t seen = 0;
+        for (int q = 0; q < 4; ++q) {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(quantile[q] * h.calls));
+            if (rank == 0) rank = 1;
+            while (b < LatencyHistogram::buckets && seen + h.count[b] < rank) seen += h.count[b++];
+            uint64_t value = std::min(LatencyHistogram::highest(b), h.max);
+            out << "\t" << std::llround(value * scale);
+        }
+        out << "\t" << std::llround(h.max * scale) << std::endl;
+    }
+    if (dropped) out << "(" << dropped << " calls in functions past " << LatencyTable::size
+                     << " per thread not timed)" << std::endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Function hooks
+//
+// Code compiled with -finstrument-functions calls __cyg_profile_func_enter
+//  and __cyg_profile_func_exit around every function, so it is counted
+//  without srcML, headers and libraries included.  Each thread counts
+//  calls by function address in a fixed open-addressed table, made on
+//  its first call; counting takes no lock and does not allocate.
+//  Addresses are named only at exit: dladdr gives the module, its ELF
+//  symbol table the function, and addr2line, if there is one, the file
+//  and line.  The report, in the format of the source-level one, goes
+//  to the file named by PROFILE_FUNCTIONS or else to standard output.
+//  profile.o itself must be compiled without -finstrument-functions.
+//
+
+struct FunctionTable {
+    static const int  size = 4096;            // Functions per thread, power of 2.
+    struct Entry {
+        const void*  fn;
+        uint64_t     calls;
+    }                 entry[size];
+    uint64_t          dropped;                // Calls of functions that did not fit.
+    FunctionTable*    next;
+};
+
+// Hooks run before the constructors of this file, so the list of tables
+//  is a constant-initialized stack rather than a vector.
+std::atomic<FunctionTable*>  functionTables(0);
+thread_local FunctionTable*  threadFunctions = 0;
+thread_local bool            inFunctionHook = false;
+
+extern "C" {
+void __cyg_profile_func_enter(void*, void*) __attribute__((no_instrument_function));
+void __cyg_profile_func_exit (void*, void*) __attribute__((no_instrument_function));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Counts a call of fn in the calling thread's table.
+//
+void __cyg_profile_func_enter(void* fn, void*) {
+    FunctionTable* table = threadFunctions;
+    if (table == 0) {
+        if (inFunctionHook) return;           // Called from making the table
+        inFunctionHook = true;
+        table = new FunctionTable();
+        table->next = functionTables.load();
+        while (!functionTables.compare_exchange_weak(table->next, table)) {}
+        threadFunctions = table;
+        inFunctionHook = false;
+    }
+    uint64_t h = (uint64_t(reinterpret_cast<uintptr_t>(fn)) >> 4) * 0x9E3779B97F4A7C15ULL >> 52;   // 12 bits
+    for (int probe = 0; probe < FunctionTable::size; ++probe) {
+        FunctionTable::Entry& e = table->entry[(h + probe) & (FunctionTable::size - 1)];
+        if (e.fn == fn) { ++e.calls; return; }
+        if (e.fn == 0) { e.fn = fn; e.calls = 1; return; }
+    }
+    ++table->dropped;
+}
+
+void __cyg_profile_func_exit(void*, void*) {
+}
+
+////////////////////////////////////////////////////////////////////////
+// The functions of an ELF file from its symbol table (or, stripped,
+//  its dynamic one), by address.  Empty if it cannot be read.
+//
+struct ElfSymbols {
+    bool                                          relocated;   // Addresses are from the load base.
+    std::map<uintptr_t, std::pair<uintptr_t, std::string> > function;   // Start => (size, name)
+
+    bool read(const std::string& path) {
+        std::ifstream in(path.c_str(), std::ios::binary);
+        std::string image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (image.size() < sizeof(ElfW(Ehdr)) || image.compare(0, 4, ELFMAG) != 0) return false;
+        const char* base = image.data();
+        const ElfW(Ehdr)* header = reinterpret_cast<const ElfW(Ehdr)*>(base);
+        if (header->e_ident[EI_CLASS] != (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32)) return false;
+        if (header->e_shoff + header->e_shnum * sizeof(ElfW(Shdr)) > image.size()) return false;
+        relocated = header->e_type == ET_DYN;
+        const ElfW(Shdr)* section = reinterpret_cast<const ElfW(Shdr)*>(base + header->e_shoff);
+        for (int pass = 0; pass < 2 && function.empty(); ++pass) {
+            for (int i = 0; i < header->e_shnum; ++i) {
+                if (section[i].sh_type != (pass == 0 ? SHT_SYMTAB : SHT_DYNSYM)) continue;
+                const ElfW(Shdr)& strings = section[section[i].sh_link];
+                if (section[i].sh_offset + section[i].sh_size > image.size() ||
+                    strings.sh_offset + strings.sh_size > image.size()) continue;
+                const ElfW(Sym)* sym = reinterpret_cast<const ElfW(Sym)*>(base + section[i].sh_offset);
+                std::size_t n = section[i].sh_size / sizeof(ElfW(Sym));
+                for (std::size_t j = 0; j < n; ++j) {
+                    if (ELF64_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value == 0) continue;
+                    if (sym[j].st_name >= strings.sh_size) continue;
+                    function[sym[j].st_value] = std::make_pair(uintptr_t(sym[j].st_size),
+                                                               std::string(base + strings.sh_offset + sym[j].st_name));
+                }
+            }
+        }
+        return !function.empty();
+    }
+
+    // Name of the function at address, or "".
+    std::string find(uintptr_t address) const {
+        std::map<uintptr_t, std::pair<uintptr_t, std::string> >::const_iterator i = function.upper_bound(address);
+        if (i == function.begin()) return "";
+        --i;
+        if (address >= i->first + std::max<uintptr_t>(i->second.first, 1)) return "";
+        return i->second.second;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////
+// File (without directory) and line of each address in module, by
+//  addr2line; where code is inlined at the address, those of the
+//  function it is inlined into.  Missing where it cannot tell.
+//
+void sourceLines(const std::string& module, const std::vector<uintptr_t>& address,
+                 std::map<uintptr_t, std::pair<std::string, int> >& where) {
+    std::ostringstream command;
+    command << "addr2line -a -i -e '" << module << "'" << std::hex;
+    for (std::size_t i = 0; i < address.size(); ++i) command << " 0x" << address[i];
+    command << " 2>/dev/null";
+    if (module.find('\'') != std::string::npos) return;
+    FILE* pipe = popen(command.str().c_str(), "r");
+    if (pipe == 0) return;
+    char line[4096];
+    uintptr_t current = 0;
+    while (std::fgets(line, sizeof(line), pipe)) {
+        std::string text(line);
+        if (text.compare(0, 2, "0x") == 0) {              // Next address
+            current = std::strtoull(text.c_str(), 0, 16);
+            continue;
+        }
+        std::string::size_type colon = text.rfind(':');
+        if (colon == std::string::npos || text.compare(0, 2, "??") == 0) continue;
+        int n = std::atoi(text.c_str() + colon + 1);
+        if (n <= 0) continue;
+        std::string file = text.substr(0, colon);
+        where[current] = std::make_pair(file.substr(file.rfind('/') + 1), n);   // Outermost last
+    }
+    pclose(pipe);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Prints the counts of the function hooks, a report per source file
+//  (or per module where addr2line cannot tell).  Prints nothing if no
+//  hook was called.
+//
+void profile_runtime::functionReport(std::ostream& out) {
+    std::map<const void*, uint64_t> calls;
+    uint64_t dropped = 0;
+    for (const FunctionTable* t = functionTables.load(); t != 0; t = t->next) {
+        dropped += t->dropped;
+        for (int i = 0; i < FunctionTable::size; ++i) {
+            const FunctionTable::Entry& e = t->entry[i];
+            if (e.fn) calls[e.fn] += e.calls;
+        }
+    }
+    if (calls.empty()) return;
+
+    // Module and address within it of each function
+    struct Module {
+        ElfSymbols              symbols;
+        bool                    loaded;
+        std::vector<uintptr_t>  address;
+    };
+    std::map<std::string, Module> modules;
+    std::map<const void*, std::pair<std::string, uintptr_t> > at;
+    for (std::map<const void*, uint64_t>::const_iterator i = calls.begin(); i != calls.end(); ++i) {
+        Dl_info info;
+        std::string path = "/proc/self/exe";
+        uintptr_t base = 0;
+        if (dladdr(i->first, &info) && info.dli_fname && *info.dli_fname) {
+            path = info.dli_fname;
+            base = reinterpret_cast<uintptr_t>(info.dli_fbase);
+        }
+        Module& m = modules[path];
+        if (m.address.empty()) {
+            m.loaded = m.symbols.read(path) || (path != "/proc/self/exe" && m.symbols.read("/proc/self/exe"));
+        }
+        uintptr_t address = reinterpret_cast<uintptr_t>(i->first);
+        if (m.loaded && m.symbols.relocated) address -= base;
+        m.address.push_back(address);
+        at[i->first] = std::make_pair(path, address);
+    }
+    std::map<std::string, std::map<uintptr_t, std::pair<std::string, int> > > where;
+    for (std::map<std::string, Module>::const_iterator m = modules.begin(); m != modules.end(); ++m)
+        sourceLines(m->first, m->second.address, where[m->first]);
+
+    // A profile per file
+    std::map<std::string, profile_runtime> files;
+    for (std::map<const void*, uint64_t>::const_iterator i = calls.begin(); i != calls.end(); ++i) {
+        const std::string& path = at[i->first].first;
+        uintptr_t address = at[i->first].second;
+        std::string name = modules[path].symbols.find(address);
+        std::ostringstream unknown;
+        unknown << "0x" << std::hex << address;
+        name = (name == "") ? unknown.str() : sourceNameOf(name);
+
+        std::string file = path.substr(path.rfind('/') + 1);
+        int line = 0;
+        std::map<uintptr_t, std::pair<std::string, int> >::const_iterator w = where[path].find(address);
+        if (w != where[path].end()) {
+            file = w->second.first;
+            line = w->second.second;
+        }
+        std::map<std::string, profile_runtime>::iterator f = files.find(file);
+        if (f == files.end()) f = files.insert(std::make_pair(file, profile_runtime(file))).first;
+        f->second.stmt[intToString(line) + " " + name] += i->second;
+    }
+    for (std::map<std::string, profile_runtime>::const_iterator f = files.begin(); f != files.end(); ++f) {
+        f->second.report(out, false, false);
+        out << std::endl;
+    }
+    if (dropped) out << "(" << dropped << " calls in functions past " << FunctionTable::size
+                     << " per thread not counted)" << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Writes the report of the function hooks at exit.
+//
+struct FunctionReporter {
+    ~FunctionReporter() {
+        const char* filename = std::getenv("PROFILE_FUNCTIONS");
+        if (filename && *filename) {
+            std::ofstream out(filename);
+            profile_runtime::functionReport(out);
+        } else {
+            profile_runtime::functionReport(std::cout);
+        }
+    }
+};
+
+FunctionReporter functionReporter;
+
+
+////////////////////////////////////////////////////////////////////////
+// Coverage
+//
+// Each instrumented file registers its site table at static
+//  initialization.  The list head is constant-initialized, so a table
+//  may register before anything else in this file is constructed.
+//
+struct SiteTable {
+    const profile_coverage*  owner;
+    const profile_site*      site;
+    int                      n;
+    SiteTable*               next;
+};
+
+std::atomic<SiteTable*> siteTables(0);
+
+void profile_coverage::addSites(const profile_coverage& p, const profile_site* site, int n) {
+    SiteTable* table = new SiteTable{&p, site, n, siteTables.load()};
+    while (!siteTables.compare_exchange_weak(table->next, table)) {}
+}
+
+////////////////////////////////////////////////////////////////////////
+// Prints the heading and rows of a report, each row with its variance
+//  as a bound if it has one.
+//
+static void printRows(std::ostream& out, const std::string& fname, const char* heading,
+                      const std::map<std::string, uint64_t>& lines,
+                      const std::map<std::string, double>& variance) {
+    out << std::endl << "File: " << fname << std::endl;
     out << "<============================================>" << std::endl;
-    out << "Line Number/Name\t\tTimes Called" << std::endl;
-    for(std::map<std::string, int>::const_iterator i = p.stmt.begin(); i != p.stmt.end(); ++i) {
+    out << "Line Number/Name\t\t" << heading << std::endl;
+    for(std::map<std::string, uint64_t>::const_iterator i = lines.begin(); i != lines.end(); ++i) {
         out << i->first;
         if (i->first.length() > 7 && i->first.length() <= 15) out << "\t\t\t";
         else if (i->first.length() > 15 && i->first.length() <= 23) out << "\t\t";
         else if (i->first.length() > 23) out << "\t";
         else out << "\t\t\t\t";
-        out << i->second << std::endl;
+        out << i->second;
+        std::map<std::string, double>::const_iterator v = variance.find(i->first);
+        if (v != variance.end()) out << " (+-" << std::llround(2 * std::sqrt(v->second)) << ")";
+        out << std::endl;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Prints every site of the file with 1 if it ran and 0 if it never
+//  did, a block giving each of its lines, then how many sites ran.
+//  Each table entry reads its own flag; sites on one line share a row,
+//  which ran if any of them did.  Lines that ran but are in no table,
+//  as from a p-*.cpp written without one, are listed as ran.
+//
+void profile_coverage::report(std::ostream& out) const {
+    std::map<std::string, uint64_t> rows;
+    std::set<int> listed;
+    uint64_t ran = 0, total = 0;
+    for (const SiteTable* t = siteTables.load(); t != 0; t = t->next) {
+        if (t->owner != this) continue;
+        for (int i = 0; i < t->n; ++i) {
+            const profile_site& s = t->site[i];
+            if (s.line <= 0) continue;                          //Numbered, never printed
+            uint64_t flag = (unsigned(i) < sites) ? hit[i].load(std::memory_order_relaxed)
+                          : (unsigned(s.line) < lines) ? lineHit[s.line].load(std::memory_order_relaxed) : 0;
+            ran += flag;
+            ++total;
+            std::string key = intToString(s.line);
+            if (s.name) key += std::string(" ") + s.name;
+            rows[key] = std::max(rows[key], flag);
+            listed.insert(s.line);
+            std::istringstream above(s.above ? s.above : "");
+            int n;
+            while (above >> n) {
+                std::string line = intToString(s.line - n);
+                rows[line] = std::max(rows[line], flag);
+            }
+        }
+    }
+    for (unsigned line = 0; line < lines; ++line) {
+        if (lineHit[line].load(std::memory_order_relaxed) && !listed.count(line)) {
+            rows[intToString(line)] = 1;
+            ++ran;
+            ++total;
+        }
+    }
+
+    printRows(out, fname, "Executed", rows, std::map<std::string, double>());
+    out << std::endl << "Executed " << ran << " of " << total << " sites" << std::endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+// Counting
+//
+// The counts of every profile are taken under one lock.  It is held
+//  across fork, so a child never starts with it held by a thread it
+//  does not have.
+//
+std::mutex profile_runtime::counting;
+
+void lockCounting()   { profile_runtime::counting.lock(); }
+void unlockCounting() { profile_runtime::counting.unlock(); }
+
+int countingAtFork = pthread_atfork(&lockCounting, &unlockCounting, &unlockCounting);
+
+
+////////////////////////////////////////////////////////////////////////
+// Prints out the profile, with the sampled counts and the latency
+//  table if the policy keeps them.
+//
+// TODO: Very simple output, need to make it into columns with nice headings.
+// 
+void profile_runtime::report(std::ostream& out, bool sampled, bool timed) const {
+    
+    std::map<std::string, uint64_t> lines;
+    std::map<std::pair<int, const char*>, uint64_t> runs;
+    std::map<std::string, double> variance;
+    {
+        std::lock_guard<std::mutex> guard(counting);
+        lines = stmt;
+        runs  = blocks;
+        if (sampled) gatherSampled(lines, variance);
+    }
+    if (live) gather(lines, runs);
+
+    // Give each line of a basic block the count of the block
+    typedef std::map<std::pair<int, const char*>, uint64_t>::const_iterator Block;
+    for (Block i = runs.begin(); i != runs.end(); ++i) {
+        lines[intToString(i->first.first)] += i->second;
+        std::istringstream above(i->first.second);
+        int n;
+        while (above >> n) lines[intToString(i->first.first - n)] += i->second;
     }
-    return out;
+
+    printRows(out, fname, "Times Called", lines, variance);
+    if (timed) latencyReport(out);
 }
 
 
@@ -15,26 +15,303 @@
 #include <cassert>
 #include <string>
 #include <map>
+#include <utility>
+#include <stdint.h>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 std::string intToString(int);
 
 
+////////////////////////////////////////////////////////////////////////
+//  What a profile does at each site, fixed at compile time.  The
+//   instrumented code names only profile, profile::call and
+//   profile::sites, so the same p-*.cpp builds with any policy:
+//   -DPROFILE_POLICY=off|count|time|sample|trace|coverage.  The default,
+//   dynamic, takes the hooks from the PROFILE_SHM, PROFILE_ADAPTIVE,
+//   PROFILE_TRACE and PROFILE_LATENCY environment variables at run time.
+//
+//   off      Nothing: the hooks are empty and the report is empty.
+//   count    Exact counts only.
+//   time     Exact counts and call latency.
+//   sample   Adaptive counts (thresholds from PROFILE_ADAPTIVE).
+//   trace    Exact counts and a trace to PROFILE_TRACE, or profile.trace.
+//   coverage Which sites ran, including those that never did.
+//
+namespace profile_policy {
+    struct off     {};
+    struct count   { enum { runtime = 0, sampled = 0, timed = 0, traced = 0 }; };
+    struct time    { enum { runtime = 0, sampled = 0, timed = 1, traced = 0 }; };
+    struct sample  { enum { runtime = 0, sampled = 1, timed = 0, traced = 0 }; };
+    struct trace   { enum { runtime = 0, sampled = 0, timed = 0, traced = 1 }; };
+    struct dynamic { enum { runtime = 1, sampled = 0, timed = 0, traced = 0 }; };
+    struct coverage {};
+}
+
+#ifndef PROFILE_POLICY
+#define PROFILE_POLICY dynamic
+#endif
+
+
+////////////////////////////////////////////////////////////////////////
+//  A site the instrumenter put in a file: its line and either its
+//   function or condition name or, for a basic block, the lines above
+//   it.  Each instrumented file ends with a table of its sites, handed
+//   to profile::sites, so the coverage report can list the sites that
+//   never ran.  The last argument of each hook is its index in the
+//   table, or -1 from code written without one.
+//
+struct profile_site {
+    int          line;
+    const char*  name;                      // 0 for a statement or block.
+    const char*  above;                     // 0 unless a block.
+};
+
+
 ////////////////////////////////////////////////////////////////////////
 //  A map of line numbers or line number function names and the number
-//   of times each is called.
+//   of times each is called.  The counters and the report, shared by
+//   every policy but off.
 // 
 //
-class profile {
+class profile_runtime {
 public:
-           profile (std::string fn="") : fname(fn)         {};
-    void   count   (int line, const std::string& funcName) { stmt[intToString(line) + " " + funcName] += 1; }
-    void   count   (int line)                              { stmt[intToString(line)] += 1; }
-    
-    friend std::ostream& operator<< (std::ostream&, const profile&);
-private:
+           profile_runtime (std::string fn="") : fname(fn), slots()  {};
+
+    static bool tracing;                    // PROFILE_TRACE names a trace file.
+    static void trace(const char*, bool);
+    static bool startTracing();
+    static bool live;                       // PROFILE_SHM: counters in shared memory.
+    static bool adaptive;                   // PROFILE_ADAPTIVE: sample hot sites.
+    static bool timing;                     // PROFILE_LATENCY: time each call.
+    static std::mutex counting;             // Guards stmt, blocks, the sampled
+                                            //  sites and slots of every profile.
+    static uint64_t ticks();
+    static void latency(const profile_runtime&, const char*, uint64_t);
+    static void functionReport(std::ostream&); // -finstrument-functions counts.
+
+    void   report   (std::ostream&, bool sampled, bool timed) const;
+
+protected:
     std::string                 fname;   // File name.
-    std::map<std::string, int>  stmt;    // (line# X times called)
+    std::map<std::string, uint64_t>  stmt;    // (line# X times called)
+    std::map<std::pair<int, const char*>, uint64_t> blocks;
+                                         // ((last line, lines above) X times run)
+
+    void   liveCount(int, const std::string&);
+    void   liveBlock(int, const char*);
+    void   gather   (std::map<std::string, uint64_t>&, std::map<std::pair<int, const char*>, uint64_t>&) const;
+    void   latencyReport(std::ostream&) const;
+
+    std::map<std::string, int>                 liveStmt;    // Key in stmt => shared site
+    std::map<std::pair<int, const char*>, int> liveBlocks;  // Key in blocks => shared site
+
+    // A counter that is exact for its first threshold hits and then
+    //  samples one hit in about period, each sample standing for period.
+    struct Site {
+        int64_t   countdown;                // Hits until the next record.
+        uint64_t  threshold, period;        // period is 1 while exact.
+        double    estimate, variance;
+    };
+    // A recently used site, by kind (0 line, 1 name, 2 block), line and
+    //  the address of its name or lines above.
+    struct Slot {
+        int         kind, line;
+        const void* key;
+        Site*       site;
+    };
+    static const int slotCount = 256;       // Power of 2.
+
+    void   hit      (Site& s)               { if (--s.countdown <= 0) record(s); }
+    Site&  site     (int kind, int line, const void* key) {
+               Slot& s = slots[(line * 31 + (reinterpret_cast<uintptr_t>(key) >> 3) + kind) & (slotCount - 1)];
+               if (s.site && s.line == line && s.key == key && s.kind == kind) return *s.site;
+               return fill(s, kind, line, key);
+           }
+    Site&  site     (const std::string&, int, const char*);
+    Site&  fill     (Slot&, int, int, const void*);
+    void   newSite  (Site&, int, const char*);
+    static void record(Site&);
+    void   gatherSampled(std::map<std::string, uint64_t>&, std::map<std::string, double>&) const;
+
+    std::map<std::string, Site>                 sampledStmt;   // Key as in stmt
+    std::map<std::pair<int, const char*>, Site> sampledBlocks; // Key as in blocks
+    Slot                                        slots[slotCount];
+};
+
+
+////////////////////////////////////////////////////////////////////////
+//  A clock for timing calls: the time stamp counter where there is one,
+//   converted to ns at report time.
+//
+inline uint64_t profile_runtime::ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////
+//  The profile of one file under Policy.  Each test on Policy is a
+//   constant, so a site costs only what the policy does.  Any thread
+//   may run a site: the counts and sampled sites are taken under
+//   counting, and live counters under their own lock.
+//
+template <class Policy>
+class basic_profile : public profile_runtime {
+public:
+           basic_profile (std::string fn="") : profile_runtime(fn)  {};
+    void   count   (int line, const std::string& funcName) { if (Policy::runtime && live) { liveCount(line, funcName); return; }
+                                                             std::lock_guard<std::mutex> guard(counting);
+                                                             if (sampling()) hit(site(intToString(line) + " " + funcName, line, funcName.c_str()));
+                                                             else stmt[intToString(line) + " " + funcName] += 1; }
+    void   count   (int line, const char* name, int = -1)  { if (Policy::runtime && live) { liveCount(line, name); return; }
+                                                             std::lock_guard<std::mutex> guard(counting);
+                                                             if (sampling()) hit(site(1, line, name));
+                                                             else stmt[intToString(line) + " " + name] += 1; }
+    void   count   (int line, int = -1)                    { if (Policy::runtime && live) { liveCount(line, ""); return; }
+                                                             std::lock_guard<std::mutex> guard(counting);
+                                                             if (sampling()) hit(site(0, line, 0));
+                                                             else stmt[intToString(line)] += 1; }
+    void   block   (int line, const char* above, int = -1) { if (Policy::runtime && live) { liveBlock(line, above); return; }
+                                                             std::lock_guard<std::mutex> guard(counting);
+                                                             if (sampling()) hit(site(2, line, above));
+                                                             else blocks[std::make_pair(line, above)] += 1; }
+
+    class call;
+    class sites {
+    public:
+        sites (basic_profile&, const profile_site*, int) {};
+    };
+
+    static bool sampling() { return Policy::sampled || (Policy::runtime && adaptive); }
+    static bool timed()    { return Policy::timed   || (Policy::runtime && timing); }
+    static bool traced()   { return Policy::traced ? tracing || startTracing() : Policy::runtime && tracing; }
+};
+
+template <class Policy>
+std::ostream& operator<< (std::ostream& out, const basic_profile<Policy>& p) {
+    p.report(out, basic_profile<Policy>::sampling(), basic_profile<Policy>::timed());
+    return out;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+//  Counts a function invocation and, when tracing, records the entry
+//   and the exit of the function.  When timing, records how long the
+//   call took.  Declared first in each function body.
+//
+template <class Policy>
+class basic_profile<Policy>::call {
+public:
+           call (basic_profile& p, int line, const char* funcName, int = -1) : prof(p), name(funcName), start(0) {
+               p.count(line, funcName);
+               if (traced()) trace(name, false);
+               if (timed()) start = ticks();
+           }
+           ~call() {
+               if (timed()) latency(prof, name, ticks() - start);
+               if (traced()) trace(name, true);
+           }
+private:
+           call (const call&);
+    void   operator=(const call&);
+
+    basic_profile& prof;
+    const char*    name;
+    uint64_t       start;
+};
+
+
+////////////////////////////////////////////////////////////////////////
+//  Profiling off: every hook is empty and inline, so an instrumented
+//   build runs as the original.
+//
+template <>
+class basic_profile<profile_policy::off> {
+public:
+    explicit basic_profile (const char* = 0)  {};
+    void     count   (int, const std::string&)       {};
+    void     count   (int, const char*, int = -1)    {};
+    void     count   (int, int = -1)                 {};
+    void     block   (int, const char*, int = -1)    {};
+
+    class call {
+    public:
+        call (basic_profile&, int, const char*, int = -1) {};
+    };
+    class sites {
+    public:
+        sites (basic_profile&, const profile_site*, int) {};
+    };
 };
 
+inline std::ostream& operator<< (std::ostream& out, const basic_profile<profile_policy::off>&) {
+    return out;
+}
+
+
+////////////////////////////////////////////////////////////////////////
+//  Which sites of a file ran, for dead code and coverage.  A site is a
+//   single relaxed store of 1 to the byte of its index in the file's
+//   site table: no lookup and no read-modify-write, and sites that
+//   share a line keep their own flag.  A hook without an index marks
+//   the byte of its line instead.  The constructor is constexpr so the
+//   bytes start zeroed before any static initializer can run a site.
+//   The report joins them with the file's site table.
+//
+class profile_coverage {
+public:
+    constexpr explicit profile_coverage (const char* fn) : fname(fn), hit(), lineHit()  {};
+    void     mark    (int line, int site) {
+                 if (unsigned(site) < sites) hit[site].store(1, std::memory_order_relaxed);
+                 else if (unsigned(line) < lines) lineHit[line].store(1, std::memory_order_relaxed);
+             }
+    void     report  (std::ostream&) const;
+    static void addSites(const profile_coverage&, const profile_site*, int);
+
+private:
+    static const unsigned sites = 1 << 16;  // Sites past this are marked by line.
+    static const unsigned lines = 1 << 16;  // Lines past this are not marked.
+
+    const char*                 fname;
+    std::atomic<unsigned char>  hit[sites];      // By index in the site table.
+    std::atomic<unsigned char>  lineHit[lines];  // By line, for hooks without one.
+};
+
+template <>
+class basic_profile<profile_policy::coverage> : public profile_coverage {
+public:
+    constexpr explicit basic_profile (const char* fn = "") : profile_coverage(fn)  {};
+    void     count   (int line, const std::string&)           { mark(line, -1); }
+    void     count   (int line, const char*, int site = -1)   { mark(line, site); }
+    void     count   (int line, int site = -1)                { mark(line, site); }
+    void     block   (int line, const char*, int site = -1)   { mark(line, site); }
+
+    class call {
+    public:
+        call (basic_profile& p, int line, const char*, int site = -1) { p.mark(line, site); }
+    };
+    class sites {
+    public:
+        sites (basic_profile& p, const profile_site* site, int n) { addSites(p, site, n); }
+    };
+};
+
+inline std::ostream& operator<< (std::ostream& out, const basic_profile<profile_policy::coverage>& p) {
+    p.report(out);
+    return out;
+}
+
+
+typedef basic_profile<profile_policy::PROFILE_POLICY> profile;
+
 
 #endif
@@ -0,0 +1,51 @@
+/*
+ *  profile_shm.hpp
+ *
+ *  Layout of the shared-memory segment that holds live profile counters.
+ *  Written by the profile runtime when PROFILE_SHM is set, read by proftop.
+ *
+ */
+
+#ifndef INCLUDES_PROFILE_SHM_H_
+#define INCLUDES_PROFILE_SHM_H_
+
+#include <atomic>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////
+//  Each process has its own segment, /profile.<pid>.  A forked child
+//   gets a new one with the same sites and counts started at zero.
+//
+//  The segment is a header followed by capacity sites.  A site is
+//   published by filling it in and then storing used + 1 (release), so
+//   a reader that loads used (acquire) sees complete sites[0, used).
+//
+const char     PROFILE_SHM_MAGIC[8] = {'P', 'R', 'O', 'F', 'S', 'H', 'M', '1'};
+const uint32_t PROFILE_SHM_VERSION  = 1;
+
+struct ProfileShmHeader {
+    char                   magic[8];     // PROFILE_SHM_MAGIC
+    uint32_t               version;
+    uint32_t               headerSize;   // sizeof(ProfileShmHeader)
+    uint32_t               siteSize;     // sizeof(ProfileShmSite)
+    uint32_t               capacity;     // Number of sites that fit.
+    std::atomic<uint32_t>  used;         // Number of sites published.
+    uint32_t               pid;
+    uint64_t               startNs;      // CLOCK_REALTIME at creation.
+    char                   program[64];
+};
+
+////////////////////////////////////////////////////////////////////////
+//  A counted site.  A function or condition has a name, a statement
+//   does not.  A basic block lists how many lines above line its other
+//   statements end, as in profile::block.
+//
+struct ProfileShmSite {
+    std::atomic<uint64_t>  count;
+    int32_t                line;
+    char                   file[44];
+    char                   name[48];
+    char                   above[40];
+};
+
+#endif
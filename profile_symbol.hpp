@@ -0,0 +1,63 @@
+/*
+ *  profile_symbol.hpp
+ *
+ *  Source names of symbols, as the instrumenter names functions.
+ *  Used by the profile runtime for its function report and by proforder
+ *  to match nm symbols to profiled functions.
+ *
+ */
+
+#ifndef INCLUDES_PROFILE_SYMBOL_H_
+#define INCLUDES_PROFILE_SYMBOL_H_
+
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+
+////////////////////////////////////////////////////////////////////////
+// Source name of a symbol: the demangled name without return type,
+//  template arguments or parameters, e.g. _Z4SWAPRiS_ => SWAP and
+//  _ZN5stack4pushEi => stack::push.  An entity local to a function
+//  keeps the function's name as its scope, e.g.
+//  main::{lambda#1}::operator(), so it is never taken for the function.
+//  A symbol that is not mangled, or has no parameters, is returned as
+//  it demangles.
+//
+inline std::string sourceNameOf(const std::string& symbol) {
+    int status;
+    char* demangled = abi::__cxa_demangle(symbol.c_str(), 0, 0, &status);
+    if (status != 0) return symbol;
+    std::string text = demangled;
+    std::free(demangled);
+
+    // The parameters are the last group in (), past any qualifiers
+    std::string::size_type params = text.rfind(')');
+    for (int depth = 0; params != std::string::npos && params > 0; --params) {
+        if (text[params] == ')') ++depth;
+        if (text[params] == '(' && --depth == 0) break;
+    }
+    if (params == std::string::npos || params == 0) return text;
+
+    // The name is the last word before them; groups in it are dropped
+    std::string name;
+    int depth = 0;
+    for (std::string::size_type i = 0; i < params; ++i) {
+        char ch = text[i];
+        if (depth == 0 && name.size() >= 8 && name.compare(name.size() - 8, 8, "operator") == 0) {
+            if (text.compare(i, 2, "()") == 0) { name += "()"; ++i; continue; }
+            while (i < params && std::strchr("<>=!+-*/%^&|~[],", text[i])) name += text[i++];
+            if (i >= params) break;
+            ch = text[i];
+        }
+        if (ch == '<' || ch == '(') ++depth;
+        if (ch == '>' || ch == ')') { --depth; continue; }
+        if (depth > 0) continue;
+        if (ch == ' ') name.clear();
+        else           name += ch;
+    }
+    return name;
+}
+
+
+#endif
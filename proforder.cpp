@@ -0,0 +1,285 @@
+////////////////////////////////////////////////////////////////////////////////
+//  proforder.cpp
+//  Profiler
+//
+//  Writes a function order for the linker from a profile, so the hot
+//   functions of a program share cache lines and pages.
+//  Call counts come from the reports of a profiled run; which function
+//   calls which comes from the srcML, each callee's count being split
+//   over its callers that ran by their own counts.  Functions are
+//   clustered along their heaviest calls (caller then callee, as in
+//   call-chain clustering) up to -page bytes, and the clusters ordered
+//   by calls per byte.  Functions never called are left out so the
+//   linker puts them after.
+//  Functions are told apart by file and name, so same-named static
+//   functions of different files are not merged.  Names are matched to
+//   symbols by demangling the nm output of the program built with
+//   -ffunction-sections; each overload of a name gets the name's count.
+//   With nm -l a symbol goes only to the function of its own file.
+//   Parts gcc splits off as cold (.cold) are left out.
+//
+//  Usage: proforder [-f lld|gold] [-page bytes] -nm nm.txt
+//                   profile.out ... file.cpp.xml ...
+//   nm.txt is the output of nm -S -l on the program.  Writes to stdout:
+//     lld:  symbols, for -fuse-ld=lld -Wl,--symbol-ordering-file=
+//     gold: sections, for -fuse-ld=gold -Wl,--section-ordering-file=
+//
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cstdlib>
+
+#include "ASTree.hpp"
+#include "report.hpp"
+#include "profile_symbol.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// A function by file and name: its calls, its symbols and what it calls.
+//  Functions are keyed by "file<tab>name", so static functions of the
+//  same name in different files stay apart.
+//
+struct Function {
+    std::string               key, file, name;
+    double                    calls;
+    std::vector<std::string>  symbols;
+    unsigned long             size;        //Bytes of its symbols
+    std::set<std::string>     callees;
+    int                       cluster;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Functions laid out together, in order.
+//
+struct Cluster {
+    std::vector<std::string>  members;
+    unsigned long             size;
+    double                    calls;
+};
+
+bool byDensity(const Cluster& a, const Cluster& b) {
+    return a.calls / std::max(a.size, 1UL) > b.calls / std::max(b.size, 1UL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sections gcc puts a function in with -ffunction-sections, but for
+//  .text.unlikely: a glob like .text*. would pull the unlikely parts of
+//  the functions in among the hot ones.
+//
+const char* hotPrefix[] = { ".text.", ".text.hot.", ".text.startup." };
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds the call counts of the function entries in a program's output,
+//  by file and name.
+//
+void readCalls(std::istream& in, std::map<std::string, double>& calls) {
+    Reports reports = readReports(in);
+    for (unsigned i = 0; i < reports.rows.size(); ++i) {
+        const ReportRow& row = reports.rows[i];
+        if (isFunction(row.name)) calls[row.file + "\t" + row.name] += row.count;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds the text symbols of nm output to functions that are named in it:
+//  "address [size] type symbol[<tab>path:line]".  With a path (nm -l)
+//  a symbol goes only to the function of that file; without one, to
+//  every function of its name.  byName gives the keys of each name.
+//
+void readSymbols(std::istream& in, std::map<std::string, Function>& functions,
+                 const std::map<std::string, std::vector<std::string> >& byName) {
+    std::string line;
+    while (std::getline(in, line)) {
+        std::string::size_type tab = line.find('\t');
+        std::string file;
+        if (tab != std::string::npos) {
+            file = line.substr(tab + 1);
+            file = file.substr(file.rfind('/') + 1);
+            file = file.substr(0, file.rfind(':'));
+            line.erase(tab);
+        }
+        std::istringstream fields(line);
+        std::vector<std::string> field;
+        std::string f;
+        while (fields >> f) field.push_back(f);
+        if (field.size() < 3) continue;                      //Undefined
+        std::string type   = field[field.size() - 2];
+        std::string symbol = field.back();
+        if (type != "T" && type != "t") continue;
+        if (symbol.find(".cold") != std::string::npos) continue;   //Split off as unlikely
+        std::map<std::string, std::vector<std::string> >::const_iterator keys = byName.find(sourceNameOf(symbol));
+        if (keys == byName.end()) continue;
+        for (unsigned k = 0; k < keys->second.size(); ++k) {
+            Function& func = functions[keys->second[k]];
+            if (file != "" && func.file != file) continue;
+            func.symbols.push_back(symbol);
+            if (field.size() == 4) func.size += std::strtoul(field[1].c_str(), 0, 16);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    std::string   format = "lld";
+    std::string   nmFile;
+    unsigned long page = 4096;
+    std::vector<std::string> outputs, sources;
+    bool ok = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if      (arg == "-f"    && i + 1 < argc) format = argv[++i];
+        else if (arg == "-nm"   && i + 1 < argc) nmFile = argv[++i];
+        else if (arg == "-page" && i + 1 < argc) page   = std::strtoul(argv[++i], 0, 10);
+        else if (arg.size() > 4 && arg.compare(arg.size() - 4, 4, ".xml") == 0) sources.push_back(arg);
+        else if (arg[0] != '-') outputs.push_back(arg);
+        else ok = false;
+    }
+    if (!ok || outputs.empty() || nmFile == "" || (format != "lld" && format != "gold")) {
+        std::cerr << "Error: Need profile outputs and an nm listing." << std::endl;
+        std::cerr << "proforder [-f lld|gold] [-page bytes] -nm nm.txt profile.out ... file.cpp.xml ..."
+                  << std::endl << std::endl;
+        return(1);
+    }
+
+    // Calls by file and function name
+    std::map<std::string, double> calls;
+    for (unsigned i = 0; i < outputs.size(); ++i) {
+        std::ifstream in(outputs[i].c_str());
+        if (!in) {
+            std::cerr << "Error: Cannot open " << outputs[i] << std::endl;
+            return(1);
+        }
+        readCalls(in, calls);
+    }
+    std::map<std::string, Function> functions;
+    std::map<std::string, std::vector<std::string> > byName;        //name -> keys
+    for (std::map<std::string, double>::const_iterator i = calls.begin(); i != calls.end(); ++i) {
+        if (i->second <= 0) continue;
+        Function& func = functions[i->first];
+        std::string::size_type tab = i->first.find('\t');
+        func.key     = i->first;
+        func.file    = i->first.substr(0, tab);
+        func.name    = i->first.substr(tab + 1);
+        func.calls   = i->second;
+        func.size    = 0;
+        func.cluster = -1;
+        byName[func.name].push_back(i->first);
+    }
+
+    // What each calls, from the sources
+    for (unsigned f = 0; f < sources.size(); ++f) {
+        std::ifstream inFile(sources[f].c_str());
+        if (!inFile) {
+            std::cerr << "Error: Cannot open " << sources[f] << std::endl;
+            return(1);
+        }
+        srcML code;
+        inFile >> code;
+        std::vector<SourceSite> sites;
+        code.sites(sites);
+        std::string file = reportNameOf(profileNameOf(sources[f]));
+        for (unsigned i = 0; i < sites.size(); ++i) {
+            std::map<std::string, Function>::iterator func = functions.find(file + "\t" + sites[i].name);
+            if (func != functions.end()) func->second.callees.insert(sites[i].calls.begin(), sites[i].calls.end());
+        }
+    }
+
+    std::ifstream nm(nmFile.c_str());
+    if (!nm) {
+        std::cerr << "Error: Cannot open " << nmFile << std::endl;
+        return(1);
+    }
+    readSymbols(nm, functions, byName);
+
+    // Callers of each function and the calls they make to it.  A callee
+    //  is the function of its name in the caller's file if there is one,
+    //  else those of its name in other files.
+    std::map<std::string, std::map<std::string, double> > callers;     //callee -> caller -> weight
+    for (std::map<std::string, Function>::const_iterator i = functions.begin(); i != functions.end(); ++i) {
+        for (std::set<std::string>::const_iterator c = i->second.callees.begin(); c != i->second.callees.end(); ++c) {
+            std::vector<std::string> callees;
+            std::string local = i->second.file + "\t" + *c;
+            if (functions.count(local)) callees.push_back(local);
+            else if (byName.count(*c))  callees = byName[*c];
+            for (unsigned k = 0; k < callees.size(); ++k) {
+                if (callees[k] != i->first) callers[callees[k]][i->first] = i->second.calls;
+            }
+        }
+    }
+    for (std::map<std::string, std::map<std::string, double> >::iterator i = callers.begin(); i != callers.end(); ++i) {
+        double total = 0;
+        for (std::map<std::string, double>::const_iterator c = i->second.begin(); c != i->second.end(); ++c)
+            total += c->second;
+        for (std::map<std::string, double>::iterator c = i->second.begin(); c != i->second.end(); ++c)
+            c->second = functions[i->first].calls * c->second / total;
+    }
+
+    // Hottest first, each function joins the cluster of its heaviest caller
+    std::vector<Function*> hottest;
+    for (std::map<std::string, Function>::iterator i = functions.begin(); i != functions.end(); ++i) {
+        if (!i->second.symbols.empty()) hottest.push_back(&i->second);
+    }
+    std::stable_sort(hottest.begin(), hottest.end(),
+                     [](const Function* a, const Function* b) { return a->calls > b->calls; });
+    std::vector<Cluster> clusters;
+    for (unsigned i = 0; i < hottest.size(); ++i) {
+        Cluster own;
+        own.members.push_back(hottest[i]->key);
+        own.size  = hottest[i]->size;
+        own.calls = hottest[i]->calls;
+        hottest[i]->cluster = clusters.size();
+        clusters.push_back(own);
+    }
+    for (unsigned i = 0; i < hottest.size(); ++i) {
+        Function* func = hottest[i];
+        const std::map<std::string, double>& from = callers[func->key];
+        const Function* best = 0;
+        double weight = 0;
+        for (std::map<std::string, double>::const_iterator c = from.begin(); c != from.end(); ++c) {
+            const Function& caller = functions[c->first];
+            if (caller.cluster < 0 || caller.cluster == func->cluster || c->second <= weight) continue;
+            best   = &caller;
+            weight = c->second;
+        }
+        if (best == 0) continue;
+        Cluster& into  = clusters[best->cluster];
+        Cluster& moved = clusters[func->cluster];
+        if (into.size + moved.size > page) continue;
+        for (unsigned m = 0; m < moved.members.size(); ++m) {
+            into.members.push_back(moved.members[m]);
+            functions[moved.members[m]].cluster = best->cluster;
+        }
+        into.size  += moved.size;
+        into.calls += moved.calls;
+        moved.members.clear();
+        moved.size = moved.calls = 0;
+    }
+    std::vector<Cluster> ordered;
+    for (unsigned i = 0; i < clusters.size(); ++i) {
+        if (!clusters[i].members.empty()) ordered.push_back(clusters[i]);
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), byDensity);
+
+    // Static functions of one name share a symbol, it is written once
+    std::set<std::string> written;
+    for (unsigned i = 0; i < ordered.size(); ++i) {
+        for (unsigned m = 0; m < ordered[i].members.size(); ++m) {
+            const Function& func = functions[ordered[i].members[m]];
+            for (unsigned s = 0; s < func.symbols.size(); ++s) {
+                if (!written.insert(func.symbols[s]).second) continue;
+                if (format == "lld") std::cout << func.symbols[s] << "\n";
+                else {
+                    for (unsigned p = 0; p < sizeof(hotPrefix) / sizeof(hotPrefix[0]); ++p)
+                        std::cout << hotPrefix[p] << func.symbols[s] << "\n";
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,291 @@
+////////////////////////////////////////////////////////////////////////////////
+//  profscale.cpp
+//  Profiler
+//
+//  Estimates how the count of each site grows with the input size.
+//   Runs a profiled program over a sweep of sizes and fits the counts
+//   of each site to y = b f(n) for f(n) = 1, log n, n, n log n, n^2
+//   and n^3 by least squares on logarithms.  A faster growing model is taken
+//   only when it leaves at most 9/10 of the squared error of the
+//   slower one, so noise does not pick a needlessly fast model.
+//   Each function's work, the sum of the counts of its sites, is
+//   fitted too, so a recursive function is judged by all its calls.
+//   With -time the program runs with PROFILE_LATENCY set and calls
+//   times median latency of each function is fitted as well.
+//  Sites are aligned across builds by file, function and line offset
+//   within the function, as in profdiff.  With -base a second build is
+//   swept too, and sites whose model grows faster than in the base
+//   are flagged.
+//
+//  Usage: profscale [-sizes n,n,...] [-time] [-base program] program [args]
+//   The size is passed as -sz n, or in place of each %n in args.
+//
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+#include "report.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// Growth models, slowest first.
+//
+const int   models = 6;
+const char* modelName[models] = {"1", "log n", "n", "n log n", "n^2", "n^3"};
+
+double growth(int model, double n) {
+    switch (model) {
+    case 0:  return 1;
+    case 1:  return std::log(n);
+    case 2:  return n;
+    case 3:  return n * std::log(n);
+    case 4:  return n * n;
+    default: return n * n * n;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A site of the program with its value at each size of the sweep.
+//
+struct Site {
+    std::string          file, function, label, metric;
+    int                  offset;
+    std::vector<double>  value;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// The best model of a site: y = b f(n) within a factor of 1 + error.
+//
+struct Fit {
+    int     model;
+    double  b, error;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds a program's output as sample run of sites.  Each row of its
+//  reports belongs to the function in its file whose entry line is the
+//  closest at or above it; the counts of a function's rows add up to
+//  its work.
+//  The latency table, if any, gives each function's time as calls
+//  times median latency.
+//
+void addRun(const std::string& output, unsigned run, std::map<std::string, Site>& sites) {
+    std::istringstream in(output);
+    std::vector<ReportRow> rows = readReports(in).rows;
+    std::map<std::string, std::map<int, std::string> > entries;   //file -> line -> func
+    for (unsigned i = 0; i < rows.size(); ++i) {
+        if (isFunction(rows[i].name)) entries[rows[i].file][rows[i].line] = rows[i].name;
+    }
+
+    std::map<std::string, double> times;
+    std::istringstream again(output);
+    std::string line;
+    bool inLatency = false;
+    while (std::getline(again, line)) {
+        if (line.compare(0, 21, "Function latency (ns)") == 0) { inLatency = true; continue; }
+        if (line == "") { inLatency = false; continue; }
+        std::vector<std::string> field = splitTabs(line);
+        if (inLatency && field.size() >= 3)
+            times[field[0]] = atof(field[1].c_str()) * atof(field[2].c_str());
+    }
+
+    for (unsigned i = 0; i < rows.size(); ++i) {
+        const ReportRow& row = rows[i];
+        std::string function;
+        int offset = row.line;
+        const std::map<int, std::string>& funcs = entries[row.file];
+        std::map<int, std::string>::const_iterator f = funcs.upper_bound(row.line);
+        if (f != funcs.begin()) {
+            --f;
+            function = f->second;
+            offset   = row.line - f->first;
+        }
+        std::ostringstream key;
+        key << row.file << '\t' << function << '\t' << offset << '\t' << row.name << "\tcount";
+        Site& site = sites[key.str()];
+        if (site.metric == "") {
+            site.file  = row.file;  site.function = function;
+            site.label = row.name;  site.offset   = offset;
+            site.metric = "count";
+        }
+        site.value.resize(run + 1, 0);
+        site.value[run] += row.count;
+        if (function == "") continue;
+
+        Site& work = sites[row.file + "\t" + function + "\t0\t\twork"];
+        if (work.metric == "") {
+            work.file   = row.file;  work.function = function;
+            work.offset = 0;         work.metric   = "work";
+        }
+        work.value.resize(run + 1, 0);
+        work.value[run] += row.count;
+    }
+    for (std::map<std::string, double>::const_iterator i = times.begin(); i != times.end(); ++i) {
+        Site& site = sites["\t" + i->first + "\t0\t\ttime"];
+        site.function = i->first;
+        site.offset   = 0;
+        site.metric   = "time";
+        site.value.resize(run + 1, 0);
+        site.value[run] += i->second;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Fits y over sizes n to each model.  The fit is done on logarithms,
+//  as counts of random inputs vary by a factor rather than a constant:
+//  log b is the mean of log y - log f(n), and the error the spread
+//  around it.  A faster model is taken only if it leaves at most 9/10
+//  of the squared error.
+//
+Fit fit(const std::vector<double>& n, const std::vector<double>& y) {
+    Fit best = {0, 0, 0};
+    double bestError = -1;
+    for (int m = 0; m < models; ++m) {
+        std::vector<double> r;
+        double mean = 0, error = 0;
+        for (unsigned i = 0; i < n.size(); ++i) {
+            r.push_back(std::log(std::max(y[i], 0.5)) - std::log(growth(m, n[i])));
+            mean += r.back();
+        }
+        mean /= n.size();
+        for (unsigned i = 0; i < r.size(); ++i) error += (r[i] - mean) * (r[i] - mean);
+        if (bestError < 0 || error <= 0.9 * bestError) {
+            Fit candidate = {m, std::exp(mean), std::exp(std::sqrt(error / n.size())) - 1};
+            best      = candidate;
+            bestError = error;
+        }
+    }
+    return best;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Quotes s for the shell.
+//
+std::string quote(const std::string& s) {
+    std::string result = "'";
+    for (unsigned i = 0; i < s.size(); ++i) {
+        if (s[i] == '\'') result += "'\\''";
+        else              result += s[i];
+    }
+    return result + "'";
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Runs program with args at each size and returns its sites.
+//  Returns false if a run fails.
+//
+bool sweep(const std::string& program, const std::vector<std::string>& args,
+           const std::vector<double>& sizes, bool timed, std::map<std::string, Site>& sites) {
+    for (unsigned s = 0; s < sizes.size(); ++s) {
+        std::ostringstream size;
+        size << static_cast<long>(sizes[s]);
+        std::string command = timed ? "PROFILE_LATENCY=1 " : "";
+        command += quote(program);
+        bool placed = false;
+        for (unsigned i = 0; i < args.size(); ++i) {
+            std::string arg = args[i];
+            for (std::string::size_type at; (at = arg.find("%n")) != std::string::npos; placed = true)
+                arg.replace(at, 2, size.str());
+            command += " " + quote(arg);
+        }
+        if (!placed) command += " -sz " + size.str();
+
+        FILE* pipe = popen(command.c_str(), "r");
+        if (pipe == 0) return false;
+        std::string output;
+        char buffer[4096];
+        std::size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), pipe)) > 0) output.append(buffer, got);
+        if (pclose(pipe) != 0) {
+            std::cerr << "Error: Failed: " << command << std::endl;
+            return false;
+        }
+        addRun(output, s, sites);
+    }
+    for (std::map<std::string, Site>::iterator i = sites.begin(); i != sites.end(); ++i)
+        i->second.value.resize(sizes.size(), 0);
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Name of a site in the output.
+//
+std::string siteName(const Site& site) {
+    std::ostringstream result;
+    if (site.file != "") result << site.file << ":";
+    result << site.function;
+    if (site.metric == "count") {
+        result << "+" << site.offset;
+        if (site.label != "" && site.offset != 0) result << " " << site.label;
+    }
+    return result.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    std::vector<double> sizes;
+    std::string base;
+    bool timed = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-sizes" && i + 1 < argc) {
+            std::istringstream list(argv[++i]);
+            std::string n;
+            while (std::getline(list, n, ',')) if (atof(n.c_str()) > 1) sizes.push_back(atof(n.c_str()));
+        }
+        else if (arg == "-base" && i + 1 < argc) base  = argv[++i];
+        else if (arg == "-time")                 timed = true;
+        else break;
+    }
+    if (sizes.empty()) {
+        double defaults[] = {250, 500, 1000, 2000, 4000};
+        sizes.assign(defaults, defaults + 5);
+    }
+    if (i >= argc || argv[i][0] == '-' || sizes.size() < 3) {
+        std::cerr << "Error: Need a program and at least 3 sizes." << std::endl;
+        std::cerr << "profscale [-sizes n,n,...] [-time] [-base program] program [args]" << std::endl << std::endl;
+        return(1);
+    }
+    std::string program = argv[i];
+    std::vector<std::string> args(argv + i + 1, argv + argc);
+
+    std::map<std::string, Site> cand, baseSites;
+    if (!sweep(program, args, sizes, timed, cand)) return(1);
+    if (base != "" && !sweep(base, args, sizes, timed, baseSites)) return(1);
+
+    std::cout << "site\tmetric\tmodel\terror\tcoefficient\tat " << static_cast<long>(sizes.back());
+    if (base != "") std::cout << "\tbase model\tregressed";
+    std::cout << "\n";
+    int regressions = 0;
+    for (std::map<std::string, Site>::const_iterator s = cand.begin(); s != cand.end(); ++s) {
+        const Site& site = s->second;
+        if (site.value.back() == 0) continue;
+        Fit f = fit(sizes, site.value);
+        std::cout << siteName(site) << '\t' << site.metric << '\t' << modelName[f.model] << '\t'
+                  << f.error << '\t' << f.b << '\t' << site.value.back();
+        if (base != "") {
+            std::map<std::string, Site>::const_iterator b = baseSites.find(s->first);
+            if (b == baseSites.end() || b->second.value.back() == 0) {
+                std::cout << "\tnew\t";
+            } else {
+                Fit old = fit(sizes, b->second.value);
+                std::cout << '\t' << modelName[old.model] << '\t';
+                if (f.model > old.model) {
+                    std::cout << "REGRESSED";
+                    ++regressions;
+                }
+            }
+        }
+        std::cout << "\n";
+    }
+    if (base != "") std::cout << regressions << " sites grow faster than in " << base << "\n";
+    return 0;
+}
@@ -0,0 +1,201 @@
+////////////////////////////////////////////////////////////////////////////////
+//  proftop.cpp
+//  Profiler
+//
+//  Shows the live counters of a process run with PROFILE_SHM set:
+//   the top functions and lines by count per second, refreshed every
+//   interval.  Attaches read-only; the process is not stopped.
+//
+//  Usage: proftop [-n top] [-i seconds] [-c refreshes] [pid]
+//   Without a pid the only profiled process is used, or they are listed.
+//
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "profile_shm.hpp"
+#include "report.hpp"
+
+////////////////////////////////////////////////////////////////////////////////
+// A row of the display: a function or a line, with its count now and
+//  its count at the previous refresh.
+//
+struct Row {
+    std::string         label;
+    unsigned long long  count, before;
+    double              rate;
+};
+
+bool byRate(const Row& a, const Row& b) {
+    if (a.rate != b.rate) return a.rate > b.rate;
+    return a.count > b.count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pids of the processes that have a segment.
+//
+std::vector<int> profiledPids() {
+    std::vector<int> result;
+    DIR* dir = opendir("/dev/shm");
+    if (dir == 0) return result;
+    while (dirent* entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, "profile.", 8) == 0)
+            result.push_back(atoi(entry->d_name + 8));
+    }
+    closedir(dir);
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Maps the segment of pid read-only.  Returns 0 on failure.
+//
+const ProfileShmHeader* attach(int pid) {
+    std::ostringstream name;
+    name << "/profile." << pid;
+    int fd = shm_open(name.str().c_str(), O_RDONLY, 0);
+    if (fd < 0) return 0;
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= static_cast<off_t>(sizeof(ProfileShmHeader)))
+        base = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return 0;
+
+    const ProfileShmHeader* header = static_cast<const ProfileShmHeader*>(base);
+    if (std::memcmp(header->magic, PROFILE_SHM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PROFILE_SHM_VERSION ||
+        header->headerSize != sizeof(ProfileShmHeader) ||
+        header->siteSize != sizeof(ProfileShmSite) ||
+        sizeof(ProfileShmHeader) + header->capacity * sizeof(ProfileShmSite) >
+            static_cast<std::size_t>(info.st_size))
+        return 0;
+    return header;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads the current counts into functions and lines, keyed by label.
+//  Basic blocks are spread over their lines as in the report.
+//
+void snapshot(const ProfileShmHeader* header,
+              std::map<std::string, unsigned long long>& functions,
+              std::map<std::string, unsigned long long>& lines) {
+    const ProfileShmSite* sites = reinterpret_cast<const ProfileShmSite*>(header + 1);
+    uint32_t used = header->used.load(std::memory_order_acquire);
+    for (uint32_t i = 0; i < used; ++i) {
+        const ProfileShmSite& site = sites[i];
+        unsigned long long count = site.count.load(std::memory_order_relaxed);
+        std::ostringstream label;
+        label << site.file << ":" << site.line;
+        if (isFunction(site.name)) {
+            functions[label.str() + " " + site.name] += count;
+            continue;
+        }
+        if (site.name[0] != 0) label << " " << site.name;
+        lines[label.str()] += count;
+
+        std::istringstream above(site.above);
+        int offset;
+        while (above >> offset) {
+            std::ostringstream other;
+            other << site.file << ":" << site.line - offset;
+            lines[other.str()] += count;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Prints the top rows of counts by rate since before.
+//
+void show(const std::string& title, const std::map<std::string, unsigned long long>& counts,
+          std::map<std::string, unsigned long long>& before, double seconds, unsigned top) {
+    std::vector<Row> rows;
+    for (std::map<std::string, unsigned long long>::const_iterator i = counts.begin(); i != counts.end(); ++i) {
+        Row row;
+        row.label  = i->first;
+        row.count  = i->second;
+        row.before = before.count(i->first) ? before[i->first] : 0;
+        row.rate   = (row.count - row.before) / seconds;
+        rows.push_back(row);
+    }
+    top = std::min<unsigned>(top, rows.size());
+    std::partial_sort(rows.begin(), rows.begin() + top, rows.end(), byRate);
+
+    std::cout << std::left << std::setw(48) << title << std::right
+              << std::setw(16) << "count" << std::setw(16) << "per second" << "\n";
+    for (unsigned i = 0; i < top; ++i) {
+        std::cout << std::left << std::setw(48) << rows[i].label << std::right
+                  << std::setw(16) << rows[i].count
+                  << std::setw(16) << std::fixed << std::setprecision(0) << rows[i].rate << "\n";
+    }
+    std::cout << "\n";
+    before = counts;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    unsigned top = 15;
+    double   interval = 1;
+    long     refreshes = -1;
+    int      pid = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if      (arg == "-n" && i + 1 < argc) top = atoi(argv[++i]);
+        else if (arg == "-i" && i + 1 < argc) interval = atof(argv[++i]);
+        else if (arg == "-c" && i + 1 < argc) refreshes = atol(argv[++i]);
+        else if (isdigit(arg[0]))             pid = atoi(arg.c_str());
+        else {
+            std::cerr << "Error: Bad option: " << arg << std::endl;
+            std::cerr << "proftop [-n top] [-i seconds] [-c refreshes] [pid]" << std::endl << std::endl;
+            return(1);
+        }
+    }
+    if (interval <= 0) interval = 1;
+
+    if (pid == 0) {
+        std::vector<int> pids = profiledPids();
+        if (pids.size() != 1) {
+            std::cerr << (pids.size() ? "Several processes are profiled, give a pid:"
+                                      : "No process is running with PROFILE_SHM set.") << std::endl;
+            for (unsigned i = 0; i < pids.size(); ++i) std::cerr << "  " << pids[i] << std::endl;
+            return(1);
+        }
+        pid = pids[0];
+    }
+    const ProfileShmHeader* header = attach(pid);
+    if (header == 0) {
+        std::cerr << "Error: Cannot attach to the profile of process " << pid << std::endl;
+        return(1);
+    }
+
+    bool tty = isatty(1);
+    std::map<std::string, unsigned long long> functions, lines, functionsBefore, linesBefore;
+    snapshot(header, functionsBefore, linesBefore);
+    for (long n = 0; refreshes < 0 || n < refreshes; ++n) {
+        usleep(static_cast<useconds_t>(interval * 1e6));
+        functions.clear();
+        lines.clear();
+        snapshot(header, functions, lines);
+
+        if (tty) std::cout << "\033[H\033[2J";
+        std::cout << "proftop  pid " << header->pid << "  " << header->program
+                  << "  sites " << header->used.load() << "\n\n";
+        show("Function", functions, functionsBefore, interval, top);
+        show("Line",     lines,     linesBefore,     interval, top);
+        std::cout.flush();
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ *  report.cpp
+ *  Profile reports
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ *  Reads the reports an instrumented program prints, for the tools
+ *   that work from them, and names profiles as the profiler does.
+ */
+
+#include "report.hpp"
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+
+
+/////////////////////////////////////////////////////////////////////
+// Reads every profile report in a program's output.
+//  A report starts with "File: name", then a rule and a heading line,
+//  then rows "line[ name]<tabs>count[<tabs>time]" up to a blank line.
+//  Other output of the program is skipped.
+//
+Reports readReports(std::istream& in) {
+    Reports result;
+    std::string line, file;
+    bool inReport = false;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 6, "File: ") == 0) {
+            file = line.substr(6);
+            result.files.push_back(file);
+            inReport = true;
+            continue;
+        }
+        if (!inReport) continue;
+        if (line == "") { inReport = false; continue; }
+        std::vector<std::string> field = splitTabs(line);
+        if (field.size() < 2 || !isdigit(field[0][0])) continue;   //Rule, heading
+
+        ReportRow row;
+        row.file  = file;
+        row.line  = atoi(field[0].c_str());
+        std::string::size_type space = field[0].find(' ');
+        row.name  = (space == std::string::npos) ? "" : field[0].substr(space + 1);
+        row.count = atof(field[1].c_str());
+        row.timed = field.size() > 2;
+        row.time  = row.timed ? atof(field[2].c_str()) : 0;
+        result.rows.push_back(row);
+    }
+    return result;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Splits s on tabs, dropping empty fields.
+//
+std::vector<std::string> splitTabs(const std::string& s) {
+    std::vector<std::string> result;
+    std::istringstream in(s);
+    std::string field;
+    while (std::getline(in, field, '\t')) {
+        if (field != "") result.push_back(field);
+    }
+    return result;
+}
+
+/////////////////////////////////////////////////////////////////////
+// True if name is one of the labels lineCount gives a condition.
+//
+bool isCondition(const std::string& name) {
+    return name == "if condition"  || name == "while condition" ||
+           name == "for condition" || name == "case condition";
+}
+
+/////////////////////////////////////////////////////////////////////
+// True if a row's name makes it a function entry rather than a
+//  statement or condition.
+//
+bool isFunction(const std::string& name) {
+    return name != "" && !isCondition(name);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Profile name of a srcML file: dir/foo.cpp.xml => foo_cpp
+//  Characters that cannot be in an identifier become _.
+//
+std::string profileNameOf(std::string filename) {
+    filename = filename.substr(filename.rfind('/') + 1);      //Remove dir
+    filename = filename.substr(0, filename.find(".xml"));      //Remove .xml
+    for (unsigned i = 0; i < filename.size(); ++i) {           //. => _
+        char ch = filename[i];
+        if (!isalnum(ch) && ch != '_') filename[i] = '_';
+    }
+    if (filename.size() > 0 && isdigit(filename[0])) filename = "_" + filename;
+    return filename;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Name a profile reports itself under: foo_cpp => foo.cpp
+//
+std::string reportNameOf(std::string profileName) {
+    std::string::size_type underscore = profileName.rfind('_');
+    if (underscore != std::string::npos) profileName[underscore] = '.';
+    return profileName;
+}
@@ -0,0 +1,50 @@
+/*
+ *  report.hpp
+ *  Profile reports
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ */
+
+#ifndef INCLUDES_REPORT_H_
+#define INCLUDES_REPORT_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+////////////////////////////////////////////////////////////////////////
+// One row of a profile report.  A function entry has a name, a
+//  condition has one of the condition labels, and a statement has
+//  neither.
+//
+struct ReportRow {
+    std::string  file;
+    int          line;
+    std::string  name;
+    double       count;
+    double       time;
+    bool         timed;
+};
+
+////////////////////////////////////////////////////////////////////////
+// The reports in a program's output: the files in the order they are
+//  reported, and the rows of all of them.
+//
+struct Reports {
+    std::vector<std::string>  files;
+    std::vector<ReportRow>    rows;
+};
+
+Reports                  readReports   (std::istream&);
+std::vector<std::string> splitTabs     (const std::string&);
+bool                     isCondition   (const std::string&);
+bool                     isFunction    (const std::string&);
+std::string              profileNameOf (std::string);
+std::string              reportNameOf  (std::string);
+
+
+#endif
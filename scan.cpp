@@ -0,0 +1,307 @@
+/*
+ *  scan.cpp
+ *  Scanning and unescaping srcML text
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ *  Compile with -DSCAN_CHECK to run every scanner the CPU supports on
+ *   each call and assert that they agree with the scalar one.
+ */
+
+#include "scan.hpp"
+#include <cassert>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+
+/////////////////////////////////////////////////////////////////////
+// Scalar scanners
+//
+static inline bool isSpaceByte(char ch) {
+    return ch == ' ' || static_cast<unsigned char>(ch - '\t') < 5;     //\t \n \v \f \r
+}
+
+static const char* findByteScalar(const char* p, const char* end, char key) {
+    while (p < end && *p != key) ++p;
+    return p;
+}
+
+static const char* findSpaceScalar(const char* p, const char* end) {
+    while (p < end && !isSpaceByte(*p)) ++p;
+    return p;
+}
+
+static const char* skipSpaceScalar(const char* p, const char* end) {
+    while (p < end && isSpaceByte(*p)) ++p;
+    return p;
+}
+
+
+#ifdef SCAN_X86
+/////////////////////////////////////////////////////////////////////
+// SSE2 scanners: 16 bytes at a time, the tail done by the scalar ones.
+//  A byte x is a space if x == ' ' or x - '\t' <= 4 (unsigned).
+//
+__attribute__((target("sse2")))
+static inline int spaceMask16(__m128i x) {
+    __m128i shifted = _mm_sub_epi8(x, _mm_set1_epi8('\t'));
+    __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+    __m128i blank   = _mm_cmpeq_epi8(x, _mm_set1_epi8(' '));
+    return _mm_movemask_epi8(_mm_or_si128(control, blank));
+}
+
+__attribute__((target("sse2")))
+static const char* findByteSSE2(const char* p, const char* end, char key) {
+    __m128i k = _mm_set1_epi8(key);
+    for (; end - p >= 16; p += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, k));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return findByteScalar(p, end, key);
+}
+
+__attribute__((target("sse2")))
+static const char* findSpaceSSE2(const char* p, const char* end) {
+    for (; end - p >= 16; p += 16) {
+        int mask = spaceMask16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return findSpaceScalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char* skipSpaceSSE2(const char* p, const char* end) {
+    for (; end - p >= 16; p += 16) {
+        int mask = ~spaceMask16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))) & 0xFFFF;
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return skipSpaceScalar(p, end);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// AVX2 scanners: 32 bytes at a time.
+//
+__attribute__((target("avx2")))
+static inline unsigned spaceMask32(__m256i x) {
+    __m256i shifted = _mm256_sub_epi8(x, _mm256_set1_epi8('\t'));
+    __m256i control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted);
+    __m256i blank   = _mm256_cmpeq_epi8(x, _mm256_set1_epi8(' '));
+    return static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(control, blank)));
+}
+
+__attribute__((target("avx2")))
+static const char* findByteAVX2(const char* p, const char* end, char key) {
+    __m256i k = _mm256_set1_epi8(key);
+    for (; end - p >= 32; p += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, k)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return findByteSSE2(p, end, key);
+}
+
+__attribute__((target("avx2")))
+static const char* findSpaceAVX2(const char* p, const char* end) {
+    for (; end - p >= 32; p += 32) {
+        unsigned mask = spaceMask32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return findSpaceSSE2(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* skipSpaceAVX2(const char* p, const char* end) {
+    for (; end - p >= 32; p += 32) {
+        unsigned mask = ~spaceMask32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        if (mask) return p + __builtin_ctz(mask);
+    }
+    return skipSpaceSSE2(p, end);
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////
+// One set of scanners, and the set picked for this CPU.
+//
+struct Scanners {
+    const char*  name;
+    const char* (*findByte) (const char*, const char*, char);
+    const char* (*findSpace)(const char*, const char*);
+    const char* (*skipSpace)(const char*, const char*);
+};
+
+static const Scanners scalarScanners = {"scalar", findByteScalar, findSpaceScalar, skipSpaceScalar};
+#ifdef SCAN_X86
+static const Scanners sse2Scanners   = {"sse2",   findByteSSE2,   findSpaceSSE2,   skipSpaceSSE2};
+static const Scanners avx2Scanners   = {"avx2",   findByteAVX2,   findSpaceAVX2,   skipSpaceAVX2};
+#endif
+
+static const Scanners& pickScanners() {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return avx2Scanners;
+    if (__builtin_cpu_supports("sse2")) return sse2Scanners;
+#endif
+    return scalarScanners;
+}
+
+static const Scanners& scanners = pickScanners();
+
+
+#ifdef SCAN_CHECK
+/////////////////////////////////////////////////////////////////////
+// Runs scan with every set the CPU supports and checks each agrees
+//  with the scalar set.
+//
+template <typename Scan>
+static const char* checked(Scan scan) {
+    const char* result = scan(scalarScanners);
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) assert(scan(sse2Scanners) == result);
+    if (__builtin_cpu_supports("avx2")) assert(scan(avx2Scanners) == result);
+#endif
+    return result;
+}
+#endif
+
+
+/////////////////////////////////////////////////////////////////////
+// Returns the first key in [p, end), or end.
+//
+const char* findByte(const char* p, const char* end, char key) {
+#ifdef SCAN_CHECK
+    return checked([=](const Scanners& s) { return s.findByte(p, end, key); });
+#else
+    return scanners.findByte(p, end, key);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the first whitespace in [p, end), or end.
+//
+const char* findSpace(const char* p, const char* end) {
+#ifdef SCAN_CHECK
+    return checked([=](const Scanners& s) { return s.findSpace(p, end); });
+#else
+    return scanners.findSpace(p, end);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Returns the first non-whitespace in [p, end), or end.
+//
+const char* skipSpace(const char* p, const char* end) {
+#ifdef SCAN_CHECK
+    return checked([=](const Scanners& s) { return s.skipSpace(p, end); });
+#else
+    return scanners.skipSpace(p, end);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////
+// Names the scanners in use.
+//
+const char* scanLevel() {
+    return scanners.name;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Writes code point c as UTF-8 at out.  Returns the bytes written.
+//
+static std::size_t writeUtf8(char* out, unsigned long c) {
+    if (c < 0x80) {
+        out[0] = static_cast<char>(c);
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = static_cast<char>(0xC0 | (c >> 6));
+        out[1] = static_cast<char>(0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = static_cast<char>(0xE0 | (c >> 12));
+        out[1] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+        out[2] = static_cast<char>(0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = static_cast<char>(0xF0 | (c >> 18));
+    out[1] = static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+    out[2] = static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    out[3] = static_cast<char>(0x80 | (c & 0x3F));
+    return 4;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Decodes the entity whose name is [p, semi) (the text between & and ;)
+//  into out.  Returns the bytes written, or 0 if it is not an entity.
+//  Every entity is longer than what it decodes to, so out may be the
+//  position of its &.
+//
+static std::size_t decodeEntity(const char* p, const char* semi, char* out) {
+    std::size_t n = semi - p;
+    if (n == 2 && p[0] == 'l' && p[1] == 't') { *out = '<'; return 1; }
+    if (n == 2 && p[0] == 'g' && p[1] == 't') { *out = '>'; return 1; }
+    if (n == 3 && std::memcmp(p, "amp",  3) == 0) { *out = '&';  return 1; }
+    if (n == 4 && std::memcmp(p, "quot", 4) == 0) { *out = '"';  return 1; }
+    if (n == 4 && std::memcmp(p, "apos", 4) == 0) { *out = '\''; return 1; }
+    if (n < 2 || p[0] != '#') return 0;
+
+    unsigned long code = 0;
+    bool hex = (p[1] == 'x' || p[1] == 'X');
+    const char* digit = p + (hex ? 2 : 1);
+    if (digit == semi) return 0;
+    for (; digit < semi; ++digit) {
+        int value;
+        if      (*digit >= '0' && *digit <= '9')       value = *digit - '0';
+        else if (hex && *digit >= 'a' && *digit <= 'f') value = *digit - 'a' + 10;
+        else if (hex && *digit >= 'A' && *digit <= 'F') value = *digit - 'A' + 10;
+        else return 0;
+        code = code * (hex ? 16 : 10) + value;
+        if (code > 0x10FFFF) return 0;
+    }
+    if (code == 0 || (code >= 0xD800 && code <= 0xDFFF)) return 0;
+    return writeUtf8(out, code);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Decodes the entities in s[0, n) in place.  Text between entities is
+//  moved down in whole runs found by findByte.
+//
+std::size_t decodeEntities(char* s, std::size_t n) {
+    const std::size_t longest = 10;                 //#x10FFFF
+    const char* end = s + n;
+    const char* p   = findByte(s, end, '&');
+    char*       out = const_cast<char*>(p);
+    while (p < end) {
+        const char* name = p + 1;
+        const char* semi = findByte(name, (end - name > std::ptrdiff_t(longest)) ? name + longest + 1 : end, ';');
+        std::size_t written = (semi < end && *semi == ';') ? decodeEntity(name, semi, out) : 0;
+        if (written) {
+            out += written;
+            p = semi + 1;
+        } else {
+            *out++ = '&';
+            p = name;
+        }
+        const char* next = findByte(p, end, '&');
+        std::memmove(out, p, next - p);
+        out += next - p;
+        p = next;
+    }
+    return out - s;
+}
+
+void decodeEntities(std::string& s) {
+    if (s.empty()) return;
+    s.resize(decodeEntities(&s[0], s.size()));
+}
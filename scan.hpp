@@ -0,0 +1,40 @@
+/*
+ *  scan.hpp
+ *  Scanning and unescaping srcML text
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ */
+
+#ifndef INCLUDES_SCAN_H_
+#define INCLUDES_SCAN_H_
+
+#include <cstddef>
+#include <string>
+
+
+////////////////////////////////////////////////////////////////////////
+// Byte scanners over [p, end) used by the reader.  Each has a scalar,
+//  an SSE2 and an AVX2 version; the best one the CPU supports is
+//  picked once at startup.  Whitespace is isspace in the C locale.
+//  Each returns the position found, or end if there is none.
+//
+const char* findByte  (const char* p, const char* end, char key);
+const char* findSpace (const char* p, const char* end);
+const char* skipSpace (const char* p, const char* end);
+
+const char* scanLevel ();           //"avx2", "sse2" or "scalar"
+
+
+////////////////////////////////////////////////////////////////////////
+// Decodes the XML entities in s[0, n) in one pass, in place: &lt;
+//  &gt; &amp; &quot; &apos; and numeric &#n; &#xh; (written as UTF-8).
+//  Anything else after a & is left as it is.  Returns the new length.
+//
+std::size_t decodeEntities(char* s, std::size_t n);
+void        decodeEntities(std::string& s);
+
+
+#endif
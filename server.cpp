@@ -0,0 +1,274 @@
+/*
+ *  server.cpp
+ *  Resident instrumentation server
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ *  profiler --serve listens on a Unix domain socket and runs the
+ *   command lines of clients on a pool of threads, so a build pays
+ *   for process startup once and reuses what earlier requests parsed.
+ *
+ *  A request is "PRQ1\n" then, each ended by a NUL, the client's
+ *   working directory, the number of arguments and the arguments.
+ *   The reply is the exit status on a line, then the error output.
+ */
+
+#include "server.hpp"
+#include <sstream>
+#include <algorithm>
+#include <queue>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/////////////////////////////////////////////////////////////////////
+// Socket used when none is given: one per user in /tmp.
+//
+std::string defaultSocket() {
+    std::ostringstream result;
+    result << "/tmp/profiler-" << getuid() << ".sock";
+    return result.str();
+}
+
+/////////////////////////////////////////////////////////////////////
+// A 64-bit FNV-1a hash and the length of text, as a cache key.
+//
+std::string contentKey(const std::string& text) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::string::size_type i = 0; i < text.size(); ++i) {
+        hash ^= static_cast<unsigned char>(text[i]);
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream result;
+    result << std::hex << hash << ':' << std::dec << text.size();
+    return result.str();
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Socket I/O
+//
+static bool writeAll(int fd, const std::string& data) {
+    const char* p = data.data();
+    std::size_t left = data.size();
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+static std::string readAll(int fd) {
+    std::string result;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        result.append(buffer, n);
+    }
+    return result;
+}
+
+static bool socketAddress(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) return false;
+    std::strcpy(address.sun_path, path.c_str());
+    return true;
+}
+
+
+const int         requestTimeout = 10000;   //Milliseconds to send a request in
+const std::size_t requestLimit   = 1 << 20; //Bytes in a request
+
+/////////////////////////////////////////////////////////////////////
+// Reads one request from fd, runs it and writes the reply.  A client
+//  that takes longer than requestTimeout to send the whole request, or
+//  sends more than requestLimit bytes, is dropped unanswered so it
+//  cannot hold a worker or fill memory.
+//
+static void answer(int fd, Handler handler) {
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(requestTimeout);
+    std::string request;
+    char buffer[4096];
+    std::vector<std::string> field;
+    std::size_t want = 2;                   //Directory and count, then args
+    std::size_t from = 5;
+    while (field.size() < want) {
+        std::size_t nul = request.find('\0', from);
+        if (nul == std::string::npos) {
+            if (request.size() > requestLimit) return;
+            long left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            deadline - std::chrono::steady_clock::now()).count();
+            pollfd readable = {fd, POLLIN, 0};
+            int ready = left > 0 ? poll(&readable, 1, static_cast<int>(left)) : 0;
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return;
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+            request.append(buffer, n);
+            continue;
+        }
+        field.push_back(request.substr(from, nul - from));
+        from = nul + 1;
+        if (field.size() == 2) want = 2 + std::strtoul(field[1].c_str(), 0, 10);
+    }
+    if (request.compare(0, 5, "PRQ1\n") != 0) return;
+
+    std::vector<std::string> args(field.begin() + 2, field.end());
+    std::ostringstream err;
+    int status;
+    try {
+        status = handler(args, field[0], err);
+    } catch (const std::exception& e) {
+        err << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
+    std::ostringstream reply;
+    reply << status << '\n' << err.str();
+    writeAll(fd, reply.str());
+}
+
+
+static volatile std::sig_atomic_t stopServing = 0;
+
+static void onStop(int) {
+    stopServing = 1;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Serves requests on the socket at path with workers threads (0 for
+//  all cores) until SIGINT or SIGTERM.  A stale socket left at path
+//  is replaced.  Returns the exit status.
+//
+int serve(const std::string& path, unsigned workers, Handler handler) {
+    sockaddr_un address;
+    if (!socketAddress(path, address)) {
+        std::cerr << "Error: Socket path is too long: " << path << std::endl;
+        return(1);
+    }
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0) {
+        if (!S_ISSOCK(info.st_mode)) {
+            std::cerr << "Error: " << path << " exists and is not a socket." << std::endl;
+            return(1);
+        }
+        unlink(path.c_str());
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool bound = false;
+    if (listener >= 0) {
+        mode_t mask = umask(077);           //Created 0600, never open to others
+        bound = bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        umask(mask);                        //No other thread runs yet
+    }
+    if (!bound || listen(listener, 64) != 0) {
+        std::cerr << "Error: Cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+        if (listener >= 0) close(listener);
+        return(1);
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT,  onStop);
+    std::signal(SIGTERM, onStop);
+
+    // Workers take accepted connections from a queue
+    std::queue<int>          pending;
+    std::mutex               lock;
+    std::condition_variable  ready;
+    bool                     done = false;
+    std::vector<std::thread> pool;
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < workers; ++i) {
+        pool.push_back(std::thread([&]() {
+            for (;;) {
+                int fd;
+                {
+                    std::unique_lock<std::mutex> hold(lock);
+                    ready.wait(hold, [&]() { return done || !pending.empty(); });
+                    if (pending.empty()) return;
+                    fd = pending.front();
+                    pending.pop();
+                }
+                answer(fd, handler);
+                close(fd);
+            }
+        }));
+    }
+
+    std::cerr << "profiler: serving on " << path << " with " << workers << " workers" << std::endl;
+    while (!stopServing) {
+        pollfd waiting = {listener, POLLIN, 0};
+        if (poll(&waiting, 1, 500) <= 0) continue;
+        int fd = accept(listener, 0, 0);
+        if (fd < 0) continue;
+        std::lock_guard<std::mutex> hold(lock);
+        pending.push(fd);
+        ready.notify_one();
+    }
+
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        done = true;
+    }
+    ready.notify_all();
+    for (unsigned i = 0; i < pool.size(); ++i) pool[i].join();
+    close(listener);
+    unlink(path.c_str());
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+// Runs args on the server at path from the current directory,
+//  copying its error output to std::cerr.  Returns false, having done
+//  nothing, if no server answers; otherwise status is its exit status.
+//
+bool callServer(const std::string& path, const std::vector<std::string>& args, int& status) {
+    sockaddr_un address;
+    if (!socketAddress(path, address)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == 0) {
+        close(fd);
+        return false;
+    }
+    std::ostringstream request;
+    request << "PRQ1\n" << cwd << '\0' << args.size() << '\0';
+    for (unsigned i = 0; i < args.size(); ++i) request << args[i] << '\0';
+    std::signal(SIGPIPE, SIG_IGN);
+    bool sent = writeAll(fd, request.str());
+    shutdown(fd, SHUT_WR);
+    std::string reply = sent ? readAll(fd) : "";
+    close(fd);
+
+    std::string::size_type newline = reply.find('\n');
+    if (newline == std::string::npos) return false;
+    status = std::atoi(reply.substr(0, newline).c_str());
+    std::cerr << reply.substr(newline + 1);
+    return true;
+}
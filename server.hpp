@@ -0,0 +1,87 @@
+/*
+ *  server.hpp
+ *  Resident instrumentation server
+ *
+ *  Copyright 2021 Kent State University. All rights reserved.
+ *  Spring 2021
+ *  Modified by: Jarod Graygo
+ *
+ */
+
+#ifndef INCLUDES_SERVER_H_
+#define INCLUDES_SERVER_H_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+
+////////////////////////////////////////////////////////////////////////
+// A request to the server: the client's working directory and its
+//  command line.  The handler runs it as the profiler would, writing
+//  errors to err, and returns the exit status.
+//
+typedef std::function<int (const std::vector<std::string>&, const std::string&, std::ostream&)> Handler;
+
+std::string defaultSocket ();
+int         serve         (const std::string&, unsigned, Handler);
+bool        callServer    (const std::string&, const std::vector<std::string>&, int&);
+std::string contentKey    (const std::string&);
+
+
+////////////////////////////////////////////////////////////////////////
+// A thread-safe cache of the last capacity values by key.  A hit
+//  moves the entry to the front; a put past capacity drops the entry
+//  at the back.  Values are shared so a hit stays valid after it is
+//  evicted.
+//
+template <typename T>
+class LruCache {
+public:
+                            LruCache (std::size_t n) : capacity(n)  {};
+    std::shared_ptr<const T> find    (const std::string&);
+    void                     put     (const std::string&, std::shared_ptr<const T>);
+
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const T> > > Entries;
+
+    std::size_t                                                  capacity;
+    Entries                                                      entries;   //Most recent first
+    std::unordered_map<std::string, typename Entries::iterator>  where;
+    std::mutex                                                   lock;
+};
+
+template <typename T>
+std::shared_ptr<const T> LruCache<T>::find(const std::string& key) {
+    std::lock_guard<std::mutex> hold(lock);
+    typename std::unordered_map<std::string, typename Entries::iterator>::iterator i = where.find(key);
+    if (i == where.end()) return std::shared_ptr<const T>();
+    entries.splice(entries.begin(), entries, i->second);
+    return i->second->second;
+}
+
+template <typename T>
+void LruCache<T>::put(const std::string& key, std::shared_ptr<const T> value) {
+    std::lock_guard<std::mutex> hold(lock);
+    typename std::unordered_map<std::string, typename Entries::iterator>::iterator i = where.find(key);
+    if (i != where.end()) {
+        i->second->second = value;
+        entries.splice(entries.begin(), entries, i->second);
+        return;
+    }
+    if (capacity == 0) return;
+    if (entries.size() == capacity) {
+        where.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.push_front(std::make_pair(key, value));
+    where[key] = entries.begin();
+}
+
+
+#endif
@@ -11,6 +11,15 @@
 #include <iomanip>
 #include <vector>
 #include <cstdlib>
+#include <cmath>
+#include <stdint.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 //==============================================================================
 // Using declarations
@@ -22,8 +31,14 @@ using std::cerr;
 //==============================================================================
 // Function declarations
 void process_command_line(Options& opts, int argc, char* argv[]);
-void generate_random_data(vector<int>& data, int size, int seed, int mod);
+void generate_random_data(vector<int>& data, int size, int seed, int mod,
+                          Distribution dist, int threads);
 void output_data(const vector<int>&);
+Distribution distribution_of(const string& name);
+void sort_with(const string& name, vector<int>& data, const Options& opts);
+void run_benchmark(const vector<int>& data, const Options& opts);
+void run_external_sort(const Options& opts);
+void write_data(const vector<int>& vec, const string& file);
 void output_usage_and_exit(const string& cmd);
 void output_error_and_exit(const string& msg);
 
@@ -36,23 +51,48 @@ int main(int argc, char* argv[])
     // Get values from the command line, opts may be changed
     process_command_line(opts, argc, argv);
 
+    // Sort a file too large for memory, no data is generated
+    if (!opts._input_file.empty())
+        { run_external_sort(opts); return 0; }
+
     // Generate data
     vector<int> data;
-    generate_random_data(data, opts._data_size, opts._seed, opts._mod);
+    generate_random_data(data, opts._data_size, opts._seed, opts._mod,
+                         opts._distribution, opts._threads);
 
     // Output data before sorting
     if(opts._output_data)
         { cout << "\nData Before: "; output_data(data); } 
 
     // Sort, if a sort was specified, there is no default
-    if (opts._quick_sort)     { quick_sort(data);      }
-    if (opts._selection_sort) { selection_sort(data);  }
-    if (opts._bubble_sort)    { bubble_sort(data);     }
+    if (opts._repetitions > 0)
+        { run_benchmark(data, opts); }
+
+    // The benchmark only sorts copies, so sort data itself to output
+    // or write it
+    if (opts._repetitions == 0 || opts._output_sorted_data ||
+        !opts._output_file.empty())
+    {
+        if (opts._quick_sort)     { quick_sort(data);      }
+        if (opts._selection_sort) { selection_sort(data);  }
+        if (opts._bubble_sort)    { bubble_sort(data);     }
+        if (opts._radix_sort)     { radix_sort(data);      }
+        if (opts._simd_sort)      { simd_sort(data);       }
+        if (opts._parallel_sort)  { parallel_sort(data, opts._threads); }
+    }
     if ( !opts._quick_sort      &&
          !opts._selection_sort  &&
-         !opts._bubble_sort  )
+         !opts._bubble_sort     &&
+         !opts._radix_sort      &&
+         !opts._simd_sort       &&
+         !opts._parallel_sort   &&
+         opts._output_file.empty() )
         { output_error_and_exit("No sort specified."); }
 
+    // Write data, sorted if a sort was specified, for -in
+    if (!opts._output_file.empty())
+        { write_data(data, opts._output_file); }
+
     // Output data after sorting
     if(opts._output_sorted_data)
         { cout << "\nData After: "; output_data(data); } 
@@ -61,19 +101,155 @@ int main(int argc, char* argv[])
 }
 
 //==============================================================================
-void generate_random_data(vector<int>& vec, int size, int seed, int mod)
+// splitmix64, used to seed xoshiro256** from a small seed
+static uint64_t splitmix64(uint64_t& state)
+{
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+//==============================================================================
+// xoshiro256** by Blackman and Vigna, a fast generator with 256 bits state
+class Xoshiro256
+{
+public:
+    explicit Xoshiro256(uint64_t seed)
+    {
+        for (int idx = 0; idx < 4; ++idx) { _s[idx] = splitmix64(seed); }
+    }
+
+    uint64_t next()
+    {
+        uint64_t result = rotl(_s[1] * 5, 7) * 9;
+        uint64_t t = _s[1] << 17;
+        _s[2] ^= _s[0];
+        _s[3] ^= _s[1];
+        _s[1] ^= _s[2];
+        _s[0] ^= _s[3];
+        _s[2] ^= t;
+        _s[3] = rotl(_s[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, bound) without modulo bias worth worrying about here
+    uint32_t below(uint32_t bound) { return uint32_t(((next() >> 32) * bound) >> 32); }
+
+    // Uniform in [0, 1)
+    double unit() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t _s[4];
+};
+
+//==============================================================================
+// Zipf distributed ranks in [1, n] with exponent 1 by rejection-inversion
+// (Hormann and Derflinger), constant time per value and no tables.
+class Zipf
+{
+public:
+    explicit Zipf(double n)
+      : _n(n)
+    {
+        _h_x1 = h_integral(1.5) - 1.0;
+        _h_n  = h_integral(n + 0.5);
+        _s    = 2.0 - h_integral_inverse(h_integral(2.5) - h(2.0));
+    }
+
+    int operator()(Xoshiro256& gen) const
+    {
+        double k = 1;
+        bool accepted = false;
+        while (!accepted)
+        {
+            double u = _h_n + gen.unit() * (_h_x1 - _h_n);
+            double x = h_integral_inverse(u);
+            k = std::floor(x + 0.5);
+            if (k < 1)  { k = 1;  }
+            if (k > _n) { k = _n; }
+            accepted = k - x <= _s || u >= h_integral(k + 0.5) - h(k);
+        }
+        return static_cast<int>(k);
+    }
+
+private:
+    static double h(double x)                  { return 1.0 / x;       }
+    static double h_integral(double x)         { return std::log(x);   }
+    static double h_integral_inverse(double x) { return std::exp(x);   }
+
+    double _n, _h_x1, _h_n, _s;
+};
+
+//==============================================================================
+// Fills vec[first, last) from the element index, or from a generator seeded
+// by the seed and the chunk, so the result does not depend on the threads.
+static void fill_chunk(vector<int>& vec, int seed, int mod, Distribution dist,
+                       vector<int>::size_type first, vector<int>::size_type last)
+{
+    const int few    = 16;
+    int       range  = mod ? mod : 0x7fffffff;
+    double    size   = static_cast<double>(vec.size());
+    Xoshiro256 gen((static_cast<uint64_t>(seed) << 32) ^ first);
+    Zipf      zipf(range);
+
+    for (vector<int>::size_type idx = first; idx < last; ++idx)
+    {
+        double up   = idx / size;                   // 0 up to < 1
+        double down = (vec.size() - 1 - idx) / size;  // < 1 down to 0
+        switch (dist)
+        {
+        case SORTED:
+        case NEARLY_SORTED: { vec[idx] = static_cast<int>(up * range);               break; }
+        case REVERSE:       { vec[idx] = static_cast<int>(down * range);             break; }
+        case ORGAN_PIPE:    { vec[idx] = static_cast<int>(std::min(up, down) * 2 * range); break; }
+        case FEW_UNIQUE:    { vec[idx] = static_cast<int>(gen.below(few) * (range / few)); break; }
+        case ZIPF:          { vec[idx] = zipf(gen) - 1;                              break; }
+        default:            { vec[idx] = static_cast<int>(gen.below(range));         break; }
+        }
+    }
+}
+
+//==============================================================================
+// Generates size values of the given shape, in parallel chunks.
+// threads <= 0 uses every hardware thread.
+void generate_random_data(vector<int>& vec, int size, int seed, int mod,
+                          Distribution dist, int threads)
 {
+    const vector<int>::size_type chunk = 1 << 16;
+
     // Resize vector
     vec.resize(size);
 
-    // Set random number generator seed
-    srandom(static_cast<unsigned int>(seed));
+    // Fill chunks, thread t takes chunks t, t + threads, ...
+    if (threads <= 0)
+        { threads = static_cast<int>(std::thread::hardware_concurrency()); }
+    if (threads < 1)
+        { threads = 1; }
+    vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+    {
+        workers.push_back(std::thread([&vec, seed, mod, dist, threads, t, chunk]()
+        {
+            for (vector<int>::size_type first = t * chunk; first < vec.size(); first += threads * chunk)
+                { fill_chunk(vec, seed, mod, dist, first, std::min(first + chunk, vec.size())); }
+        }));
+    }
+    for (int t = 0; t < threads; ++t)
+        { workers[t].join(); }
 
-    // Put random values in vector
-    for (vector<int>::size_type idx = 0; idx < vec.size(); ++idx)
+    // Nearly sorted: swap about 1% of the elements with a close neighbour
+    if (dist == NEARLY_SORTED && vec.size() > 1)
     {
-        if(mod) { vec[idx] = random() % mod; }
-        else    { vec[idx] = random();       }
+        Xoshiro256 gen(static_cast<uint64_t>(seed));
+        for (vector<int>::size_type swaps = vec.size() / 100 + 1; swaps > 0; --swaps)
+        {
+            vector<int>::size_type idx = gen.below(static_cast<uint32_t>(vec.size()));
+            vector<int>::size_type jdx = std::min(idx + 1 + gen.below(16), vec.size() - 1);
+            std::swap(vec[idx], vec[jdx]);
+        }
     }
 }
 
@@ -118,6 +294,9 @@ void process_command_line(Options& opts, int argc, char* argv[])
         if (opt == "-qs")  { opts._quick_sort         = true;  }
         if (opt == "-ss")  { opts._selection_sort     = true;  }
         if (opt == "-bs")  { opts._bubble_sort        = true;  }
+        if (opt == "-rxs") { opts._radix_sort         = true;  }
+        if (opt == "-vs")  { opts._simd_sort          = true;  }
+        if (opt == "-ps")  { opts._parallel_sort      = true;  }
         if (opt == "-od")  { opts._output_data        = true;  }
         if (opt == "-osd") { opts._output_sorted_data = true;  }
         if (opt == "-sz")
@@ -135,10 +314,61 @@ void process_command_line(Options& opts, int argc, char* argv[])
             if (idx + 1 < argc) { ++idx; opts._mod = atoi(argv[idx]); }
             else                { output_error_and_exit("Value for -mod option is missing."); }
         }
+        if (opt == "-dist")
+        {
+            if (idx + 1 < argc) { ++idx; opts._distribution = distribution_of(argv[idx]); }
+            else                { output_error_and_exit("Value for -dist option is missing."); }
+        }
+        if (opt == "-bench")
+        {
+            if (idx + 1 < argc) { ++idx; opts._repetitions = atoi(argv[idx]); }
+            else                { output_error_and_exit("Value for -bench option is missing."); }
+        }
+        if (opt == "-warm")
+        {
+            if (idx + 1 < argc) { ++idx; opts._warmup = atoi(argv[idx]); }
+            else                { output_error_and_exit("Value for -warm option is missing."); }
+        }
+        if (opt == "-cpu")
+        {
+            if (idx + 1 < argc) { ++idx; opts._cpu = atoi(argv[idx]); }
+            else                { output_error_and_exit("Value for -cpu option is missing."); }
+        }
+        if (opt == "-in")
+        {
+            if (idx + 1 < argc) { ++idx; opts._input_file = argv[idx]; }
+            else                { output_error_and_exit("Value for -in option is missing."); }
+        }
+        if (opt == "-out")
+        {
+            if (idx + 1 < argc) { ++idx; opts._output_file = argv[idx]; }
+            else                { output_error_and_exit("Value for -out option is missing."); }
+        }
+        if (opt == "-mem")
+        {
+            if (idx + 1 < argc) { ++idx; opts._memory_mb = atoi(argv[idx]); }
+            else                { output_error_and_exit("Value for -mem option is missing."); }
+        }
+        if (opt == "-t")
+        {
+            if (idx + 1 < argc) { ++idx; opts._threads = atoi(argv[idx]); }
+            else                { output_error_and_exit("Value for -t option is missing."); }
+        }
         if ( (opt != "-h")   &&
              (opt != "-qs")  &&
              (opt != "-ss")  &&
              (opt != "-bs")  &&
+             (opt != "-rxs") &&
+             (opt != "-vs")  &&
+             (opt != "-ps")  &&
+             (opt != "-t")   &&
+             (opt != "-dist") &&
+             (opt != "-bench") &&
+             (opt != "-warm") &&
+             (opt != "-cpu")  &&
+             (opt != "-in")  &&
+             (opt != "-out") &&
+             (opt != "-mem") &&
              (opt != "-od")  &&
              (opt != "-osd") &&
              (opt != "-sz")  &&
@@ -148,6 +378,140 @@ void process_command_line(Options& opts, int argc, char* argv[])
            output_error_and_exit(string("Error: Bad option: ") + opt);
         }
     }
+    if (!opts._input_file.empty() && opts._output_file.empty())
+        { output_error_and_exit("-in needs an -out file."); }
+    if (opts._memory_mb < 1)
+        { output_error_and_exit("Value for -mem must be at least 1."); }
+    if (opts._cpu >= 0 && opts._parallel_sort)
+        { output_error_and_exit("-cpu cannot be used with -ps, its threads would share the CPU."); }
+}
+
+//==============================================================================
+void sort_with(const string& name, vector<int>& data, const Options& opts)
+{
+    if (name == "quick")     { quick_sort(data);      }
+    if (name == "selection") { selection_sort(data);  }
+    if (name == "bubble")    { bubble_sort(data);     }
+    if (name == "radix")     { radix_sort(data);      }
+    if (name == "simd")      { simd_sort(data);       }
+    if (name == "parallel")  { parallel_sort(data, opts._threads); }
+}
+
+//==============================================================================
+// Runs each selected sort opts._warmup times untimed and then
+// opts._repetitions times timed, each on a fresh copy of data.
+// Writes one tab separated line per sort, after a header line.
+void run_benchmark(const vector<int>& data, const Options& opts)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    // Pin to one CPU so runs do not migrate
+    if (opts._cpu >= 0)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(opts._cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0)
+            { output_error_and_exit("Cannot pin to the CPU given by -cpu."); }
+#else
+        cerr << "Warning: -cpu is not supported here, not pinned.\n";
+#endif
+    }
+
+    // Selected sorts, in the order the usage message gives
+    vector<string> names;
+    if (opts._quick_sort)     { names.push_back("quick");     }
+    if (opts._selection_sort) { names.push_back("selection"); }
+    if (opts._bubble_sort)    { names.push_back("bubble");    }
+    if (opts._radix_sort)     { names.push_back("radix");     }
+    if (opts._simd_sort)      { names.push_back("simd");      }
+    if (opts._parallel_sort)  { names.push_back("parallel");  }
+
+    cout << "sort\tsize\treps\tmin_s\tmedian_s\tp99_s\telements_per_s\tcomparisons_per_element\n";
+    for (vector<string>::size_type idx = 0; idx < names.size(); ++idx)
+    {
+        vector<int> copy;
+        for (int rep = 0; rep < opts._warmup; ++rep)
+            { copy = data; sort_with(names[idx], copy, opts); }
+
+        vector<double> seconds;
+        unsigned long long comparisons = 0;
+        for (int rep = 0; rep < opts._repetitions; ++rep)
+        {
+            copy = data;
+            unsigned long long before = sort_comparisons;
+            Clock::time_point start = Clock::now();
+            sort_with(names[idx], copy, opts);
+            Clock::time_point stop = Clock::now();
+            comparisons += sort_comparisons - before;
+            seconds.push_back(std::chrono::duration<double>(stop - start).count());
+        }
+
+        // Nearest rank percentiles
+        std::sort(seconds.begin(), seconds.end());
+        vector<double>::size_type count = seconds.size();
+        double median = seconds[(count - 1) / 2];
+        double p99    = seconds[static_cast<vector<double>::size_type>(std::ceil(0.99 * count)) - 1];
+        double size   = static_cast<double>(data.size());
+
+        cout << names[idx]                               << '\t'
+             << data.size()                              << '\t'
+             << count                                    << '\t'
+             << seconds[0]                               << '\t'
+             << median                                   << '\t'
+             << p99                                      << '\t'
+             << (median > 0 ? size / median : 0)         << '\t'
+             << (size > 0 ? comparisons / count / size : 0) << '\n';
+    }
+}
+
+//==============================================================================
+// Sorts opts._input_file into opts._output_file in opts._memory_mb of
+// memory.  Writes a tab separated line, after a header line.
+void run_external_sort(const Options& opts)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    External_Stats stats;
+    Clock::time_point start = Clock::now();
+    if (!external_sort(opts._input_file, opts._output_file,
+                       std::size_t(opts._memory_mb) << 20, opts._threads, stats))
+        { output_error_and_exit("Cannot sort " + opts._input_file + " into " + opts._output_file); }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    cout << "sort\tsize\truns\tmerge_passes\tseconds\telements_per_s\n";
+    cout << "external"                                     << '\t'
+         << stats._elements                                << '\t'
+         << stats._runs                                    << '\t'
+         << stats._passes                                  << '\t'
+         << seconds                                        << '\t'
+         << (seconds > 0 ? stats._elements / seconds : 0)  << '\n';
+}
+
+//==============================================================================
+// Writes vec to file as native ints, the format -in reads.
+void write_data(const vector<int>& vec, const string& file)
+{
+    std::FILE* out = std::fopen(file.c_str(), "wb");
+    if (out == 0 ||
+        (!vec.empty() && std::fwrite(&vec[0], sizeof(int), vec.size(), out) != vec.size()) ||
+        std::fclose(out) != 0)
+        { output_error_and_exit("Cannot write " + file); }
+}
+
+//==============================================================================
+Distribution distribution_of(const string& name)
+{
+    if (name == "uniform") { return UNIFORM;       }
+    if (name == "sorted")  { return SORTED;        }
+    if (name == "reverse") { return REVERSE;       }
+    if (name == "nearly")  { return NEARLY_SORTED; }
+    if (name == "few")     { return FEW_UNIQUE;    }
+    if (name == "organ")   { return ORGAN_PIPE;    }
+    if (name == "zipf")    { return ZIPF;          }
+    output_error_and_exit(string("Bad distribution: ") + name);
+    return UNIFORM;
 }
 
 //==============================================================================
@@ -159,19 +523,38 @@ void output_usage_and_exit(const string& cmd)
        "     -sz  int  The number of data items\n"
        "     -rs  int  The random number generator seed\n"
        "     -mod int  The mod value for random numbers\n"
+       "     -dist name  Data shape: uniform (default), sorted, reverse,\n"
+       "               nearly, few, organ or zipf\n"
        "     -od       Output data to be sorted\n"
        "     -osd      Output sorted data\n"
        "     -qs       Use quick sort\n"
        "     -ss       Use selection sort\n"
        "     -bs       Use bubble sort\n"
+       "     -rxs      Use LSD radix sort\n"
+       "     -vs       Use SIMD sorting network sort\n"
+       "     -ps       Use parallel quick sort\n"
+       "     -t   int  Threads for parallel sort (default: all)\n"
+       "     -bench int  Time each selected sort int times, tab separated\n"
+       "     -warm int   Untimed runs before timing (default 1)\n"
+       "     -cpu int    Pin to this CPU while timing, not with -ps\n"
+       "     -out file   Write the data, sorted if a sort is given, as\n"
+       "               binary ints to file\n"
+       "     -in  file   Sort the binary ints in file into the -out file\n"
+       "               without holding them all in memory\n"
+       "     -mem int    Memory for -in in MB (default 256)\n"
        "     -h        This message\n"
        "\n"
-       "  A sort must be specified, there is no default sort.\n"
+       "  A sort or -out must be specified, there is no default sort.\n"
+       "  With -bench every selected sort is timed on copies of the same data.\n"
+       "  With -in no data is generated and no other sort is done.\n"
        "  If more than 1 sort is specified then the first sort\n"
        "  specified from the following order will be done.\n"
        "     1. quick\n"
        "     2. selection\n"
-       "     3. bubble\n";
+       "     3. bubble\n"
+       "     4. radix\n"
+       "     5. SIMD\n"
+       "     6. parallel\n";
 
     exit(0);
 }
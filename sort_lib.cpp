@@ -11,11 +11,25 @@
 //==============================================================================
 #include "sort_lib.h"
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <climits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 //==============================================================================
 // Make shorter type names
 typedef std::vector<int>::size_type Vec_Idx;
 
+//==============================================================================
+unsigned long long sort_comparisons = 0;
+
 //==============================================================================
 // Function declarations, uppercase so those stand out
 void quick_sort(std::vector<int>& data, int left, int right);
@@ -128,6 +142,7 @@ void SWAP(int& n1, int& n2)
 // This is here so the number of calls can be counted.
 bool LESS_THAN(int n1, int n2)
 {
+    ++sort_comparisons;
     return n1 < n2;
 }
 
@@ -135,6 +150,568 @@ bool LESS_THAN(int n1, int n2)
 // This is here so the number of calls can be counted.
 bool GREATER_THAN(int n1, int n2)
 {
+    ++sort_comparisons;
     return n1 > n2;
 }
 
+//==============================================================================
+// LSD radix sort, one byte per pass.  The sign bit is flipped so negative
+// numbers order before positive ones.  Passes where every element falls in
+// one bucket are skipped.
+void radix_sort(std::vector<int>& data)
+{
+    // Count every digit of every element in one read of the data
+    Vec_Idx count[4][257] = { { 0 } };
+    for (Vec_Idx idx = 0; idx < data.size(); ++idx)
+    {
+        unsigned int key = static_cast<unsigned int>(data[idx]) ^ 0x80000000u;
+        for (int pass = 0; pass < 4; ++pass)
+            { ++count[pass][((key >> (8 * pass)) & 0xff) + 1]; }
+    }
+
+    // Scatter back and forth between data and buffer
+    std::vector<int> buffer(data.size());
+    std::vector<int>* from = &data;
+    std::vector<int>* to   = &buffer;
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        Vec_Idx* offset = count[pass];
+        bool one_bucket = false;
+        for (int digit = 1; digit <= 256; ++digit)
+        {
+            if (offset[digit] == data.size()) { one_bucket = true; }
+            offset[digit] += offset[digit - 1];
+        }
+        if (one_bucket) { continue; }
+
+        for (Vec_Idx idx = 0; idx < from->size(); ++idx)
+        {
+            unsigned int key = static_cast<unsigned int>((*from)[idx]) ^ 0x80000000u;
+            (*to)[offset[(key >> (8 * pass)) & 0xff]++] = (*from)[idx];
+        }
+        std::swap(from, to);
+    }
+
+    if (from != &data) { data.swap(buffer); }
+}
+
+#ifdef __SSE2__
+//==============================================================================
+// SSE2 has no 32-bit min/max, so build them from a compare and masks.
+// Afterwards a holds the smaller and b the larger of each lane.
+static inline void minmax(__m128i& a, __m128i& b)
+{
+    __m128i gt = _mm_cmpgt_epi32(a, b);
+    __m128i lo = _mm_or_si128(_mm_and_si128(gt, b), _mm_andnot_si128(gt, a));
+    __m128i hi = _mm_or_si128(_mm_and_si128(gt, a), _mm_andnot_si128(gt, b));
+    a = lo;
+    b = hi;
+}
+
+//==============================================================================
+// Sorts 16 ints into four sorted runs of 4: a sorting network down the
+// columns of four registers, then a transpose.
+static inline void sort_16(int* p)
+{
+    __m128i r0 = _mm_loadu_si128(reinterpret_cast<__m128i*>(p));
+    __m128i r1 = _mm_loadu_si128(reinterpret_cast<__m128i*>(p + 4));
+    __m128i r2 = _mm_loadu_si128(reinterpret_cast<__m128i*>(p + 8));
+    __m128i r3 = _mm_loadu_si128(reinterpret_cast<__m128i*>(p + 12));
+
+    minmax(r0, r1); minmax(r2, r3);
+    minmax(r0, r2); minmax(r1, r3);
+    minmax(r1, r2);
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p),      _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 4),  _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 8),  _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 12), _mm_unpackhi_epi64(t2, t3));
+}
+
+//==============================================================================
+// Bitonic merge of two sorted registers.  Afterwards a holds the four
+// smallest and b the four largest, both sorted.
+static inline void merge_8(__m128i& a, __m128i& b)
+{
+    b = _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 1, 2, 3));
+    minmax(a, b);
+
+    __m128i lo = _mm_unpacklo_epi64(a, b);
+    __m128i hi = _mm_unpackhi_epi64(a, b);
+    minmax(lo, hi);
+
+    __m128i u = _mm_unpacklo_epi32(lo, hi);
+    __m128i v = _mm_unpackhi_epi32(lo, hi);
+    __m128i x = _mm_unpacklo_epi64(u, v);
+    __m128i y = _mm_unpackhi_epi64(u, v);
+    minmax(x, y);
+
+    a = _mm_unpacklo_epi32(x, y);
+    b = _mm_unpackhi_epi32(x, y);
+}
+
+//==============================================================================
+// Merges sorted runs [a, a + na) and [b, b + nb) into out four at a time.
+// Run lengths are multiples of 4.  Returns the comparisons made.
+static unsigned long long merge_runs(const int* a, Vec_Idx na, const int* b, Vec_Idx nb, int* out)
+{
+    unsigned long long compares = 0;
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+    Vec_Idx ia = 4, ib = 4;
+    while (true)
+    {
+        merge_8(lo, hi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), lo);
+        out += 4;
+        compares += 13;
+
+        // Take the next four from the run whose head is smaller
+        if (ia < na && (ib >= nb || a[ia] <= b[ib]))
+            { lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + ia)); ia += 4; }
+        else if (ib < nb)
+            { lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + ib)); ib += 4; }
+        else
+            { break; }
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), hi);
+    return compares;
+}
+#endif
+
+//==============================================================================
+// Sorting-network sort for int32.  Blocks of 16 are sorted in registers
+// into runs of 4, then runs are merged bottom-up with a bitonic network.
+// The data is padded with INT_MAX to a multiple of 16.  Without SSE2 this
+// falls back to std::sort.
+void simd_sort(std::vector<int>& data)
+{
+#ifdef __SSE2__
+    Vec_Idx size = data.size();
+    if (size < 2)
+        { return; }
+
+    data.resize((size + 15) / 16 * 16, INT_MAX);
+    Vec_Idx padded = data.size();
+    for (Vec_Idx idx = 0; idx < padded; idx += 16)
+        { sort_16(&data[idx]); }
+    sort_comparisons += padded / 16 * 20;
+
+    // Merge runs of width 4, 8, 16, ... until one run is left
+    std::vector<int> buffer(padded);
+    int* from = &data[0];
+    int* to   = &buffer[0];
+    for (Vec_Idx width = 4; width < padded; width *= 2)
+    {
+        for (Vec_Idx left = 0; left < padded; left += 2 * width)
+        {
+            Vec_Idx mid   = std::min(left + width, padded);
+            Vec_Idx right = std::min(left + 2 * width, padded);
+            if (mid == right)
+                { std::copy(from + left, from + right, to + left); }
+            else
+                { sort_comparisons += merge_runs(from + left, mid - left, from + mid, right - mid, to + left); }
+        }
+        std::swap(from, to);
+    }
+
+    if (from != &data[0]) { data.swap(buffer); }
+    data.resize(size);
+#else
+    std::sort(data.begin(), data.end());
+#endif
+}
+
+//==============================================================================
+// A fork-join pool with a task deque per thread.  A thread pushes and pops
+// its own tasks at the back and steals from the front of the others.
+// Threads waiting on a join run tasks instead of blocking.
+class Work_Pool
+{
+public:
+    explicit Work_Pool(int threads);
+    ~Work_Pool();
+
+    void spawn(const std::function<void()>& fn, std::atomic<int>& pending);
+    void wait(std::atomic<int>& pending);
+
+private:
+    struct Task
+    {
+        std::function<void()> fn;
+        std::atomic<int>*     pending;
+    };
+    struct Queue
+    {
+        std::mutex       lock;
+        std::deque<Task> tasks;
+    };
+
+    bool run_one(int self);
+    void worker(int self);
+
+    std::vector<Queue*>      _queues;
+    std::vector<std::thread> _threads;
+    std::atomic<bool>        _done;
+
+    static thread_local int  _self;
+};
+
+thread_local int Work_Pool::_self = 0;
+
+//==============================================================================
+// The calling thread owns queue 0.
+Work_Pool::Work_Pool(int threads)
+  : _done(false)
+{
+    if (threads < 1) { threads = 1; }
+    for (int idx = 0; idx < threads; ++idx)
+        { _queues.push_back(new Queue); }
+    _self = 0;
+    for (int idx = 1; idx < threads; ++idx)
+        { _threads.push_back(std::thread(&Work_Pool::worker, this, idx)); }
+}
+
+//==============================================================================
+Work_Pool::~Work_Pool()
+{
+    _done = true;
+    for (Vec_Idx idx = 0; idx < _threads.size(); ++idx)
+        { _threads[idx].join(); }
+    for (Vec_Idx idx = 0; idx < _queues.size(); ++idx)
+        { delete _queues[idx]; }
+}
+
+//==============================================================================
+void Work_Pool::spawn(const std::function<void()>& fn, std::atomic<int>& pending)
+{
+    ++pending;
+    Task task = { fn, &pending };
+    std::lock_guard<std::mutex> guard(_queues[_self]->lock);
+    _queues[_self]->tasks.push_back(task);
+}
+
+//==============================================================================
+// Help run tasks until every task counted in pending is done.
+void Work_Pool::wait(std::atomic<int>& pending)
+{
+    while (pending > 0)
+    {
+        if (!run_one(_self)) { std::this_thread::yield(); }
+    }
+}
+
+//==============================================================================
+// Runs the newest own task, or else the oldest task of another thread.
+bool Work_Pool::run_one(int self)
+{
+    Task task;
+    bool found = false;
+    int  count = static_cast<int>(_queues.size());
+    for (int idx = 0; idx < count && !found; ++idx)
+    {
+        Queue* queue = _queues[(self + idx) % count];
+        std::lock_guard<std::mutex> guard(queue->lock);
+        if (queue->tasks.empty()) { continue; }
+        if (idx == 0) { task = queue->tasks.back();  queue->tasks.pop_back();  }
+        else          { task = queue->tasks.front(); queue->tasks.pop_front(); }
+        found = true;
+    }
+    if (!found)
+        { return false; }
+
+    task.fn();
+    --*task.pending;
+    return true;
+}
+
+//==============================================================================
+void Work_Pool::worker(int self)
+{
+    _self = self;
+    while (!_done)
+    {
+        if (!run_one(self)) { std::this_thread::yield(); }
+    }
+}
+
+//==============================================================================
+// Parallel quick sort: partition, run the left part as a task that any
+// thread may steal, sort the right part here.  Small parts use std::sort.
+// Comparisons are added to compares once per task.
+static void parallel_sort(Work_Pool& pool, int* first, int* last,
+                          std::atomic<unsigned long long>& compares)
+{
+    const long cutoff = 1 << 14;
+    std::atomic<int> pending(0);
+    unsigned long long local = 0;
+    while (last - first > cutoff)
+    {
+        // Median of three pivot, Hoare partition
+        int* mid = first + (last - first) / 2;
+        int pivot = std::max(std::min(*first, *mid), std::min(std::max(*first, *mid), *(last - 1)));
+        int* idx = first;
+        int* jdx = last - 1;
+        while (idx <= jdx)
+        {
+            while (++local, *idx < pivot) { ++idx; }
+            while (++local, *jdx > pivot) { --jdx; }
+            if (idx <= jdx)      { std::swap(*idx, *jdx); ++idx; --jdx; }
+        }
+
+        int* left_last = jdx + 1;
+        pool.spawn(std::bind(static_cast<void (*)(Work_Pool&, int*, int*,
+                                                  std::atomic<unsigned long long>&)>(parallel_sort),
+                             std::ref(pool), first, left_last, std::ref(compares)), pending);
+        first = idx;
+    }
+    std::sort(first, last, [&local](int n1, int n2) { ++local; return n1 < n2; });
+    compares += local;
+    pool.wait(pending);
+}
+
+//==============================================================================
+// threads <= 0 uses every hardware thread.
+void parallel_sort(std::vector<int>& data, int threads)
+{
+    if (data.size() < 2)
+        { return; }
+    if (threads <= 0)
+        { threads = static_cast<int>(std::thread::hardware_concurrency()); }
+
+    std::atomic<unsigned long long> compares(0);
+    {
+        Work_Pool pool(threads);
+        parallel_sort(pool, &data[0], &data[0] + data.size(), compares);
+    }
+    sort_comparisons += compares;
+}
+
+//==============================================================================
+// External sort
+//
+// Runs of budget bytes are read, sorted with parallel_sort and written to
+// temporary files.  Runs are merged fan_in at a time with a loser tree,
+// each run read through a buffer of its share of the budget, until one is
+// left.  All I/O is whole buffers with fread and fwrite.
+
+//==============================================================================
+// Reads ints from a file through a buffer.
+class Run_Reader
+{
+public:
+    Run_Reader(std::FILE* file, Vec_Idx buffer_ints)
+      : _file(file), _buffer(buffer_ints), _pos(0), _len(0), _error(false)
+        { refill(); }
+
+    bool done() const  { return _pos == _len; }
+    int  head() const  { return _buffer[_pos]; }
+    bool error() const { return _error; }
+
+    void advance()
+    {
+        if (++_pos == _len) { refill(); }
+    }
+
+private:
+    void refill()
+    {
+        _pos = 0;
+        _len = std::fread(&_buffer[0], sizeof(int), _buffer.size(), _file);
+        if (_len < _buffer.size() && std::ferror(_file)) { _error = true; }
+    }
+
+    std::FILE*       _file;
+    std::vector<int> _buffer;
+    Vec_Idx          _pos, _len;
+    bool             _error;
+};
+
+//==============================================================================
+// Writes ints to a file through a buffer.
+class Run_Writer
+{
+public:
+    Run_Writer(std::FILE* file, Vec_Idx buffer_ints)
+      : _file(file), _buffer(buffer_ints), _len(0), _error(false)
+        { }
+
+    void put(int value)
+    {
+        _buffer[_len++] = value;
+        if (_len == _buffer.size()) { flush(); }
+    }
+
+    // Returns false if a write failed
+    bool flush()
+    {
+        if (_len > 0 && std::fwrite(&_buffer[0], sizeof(int), _len, _file) != _len)
+            { _error = true; }
+        _len = 0;
+        return !_error && std::fflush(_file) == 0;
+    }
+
+private:
+    std::FILE*       _file;
+    std::vector<int> _buffer;
+    Vec_Idx          _len;
+    bool             _error;
+};
+
+//==============================================================================
+// Tournament tree of losers over k runs.  Node 0 holds the winner, the run
+// with the smallest head; nodes 1 .. k-1 hold the loser of the match there.
+// The leaf of run r is node k + r.  Replacing the winner replays only its
+// path to the root, log2 k comparisons.  A finished run loses every match.
+class Loser_Tree
+{
+public:
+    explicit Loser_Tree(std::vector<Run_Reader*>& runs)
+      : _runs(runs), _k(runs.size()), _loser(runs.size(), 0)
+        { _loser[0] = build(1); }
+
+    bool empty() const { return _runs[_loser[0]]->done(); }
+    int  top() const   { return _runs[_loser[0]]->head(); }
+
+    void pop()
+    {
+        Vec_Idx winner = _loser[0];
+        _runs[winner]->advance();
+        for (Vec_Idx node = (winner + _k) / 2; node > 0; node /= 2)
+        {
+            if (beats(_loser[node], winner)) { std::swap(_loser[node], winner); }
+        }
+        _loser[0] = winner;
+    }
+
+private:
+    Vec_Idx build(Vec_Idx node)
+    {
+        if (node >= _k) { return node - _k; }
+        Vec_Idx left  = build(2 * node);
+        Vec_Idx right = build(2 * node + 1);
+        if (beats(left, right)) { _loser[node] = right; return left; }
+        _loser[node] = left;
+        return right;
+    }
+
+    bool beats(Vec_Idx a, Vec_Idx b)
+    {
+        if (_runs[a]->done()) { return false; }
+        if (_runs[b]->done()) { return true;  }
+        ++sort_comparisons;
+        return _runs[a]->head() < _runs[b]->head() ||
+               (_runs[a]->head() == _runs[b]->head() && a < b);
+    }
+
+    std::vector<Run_Reader*>& _runs;
+    Vec_Idx                   _k;
+    std::vector<Vec_Idx>      _loser;
+};
+
+//==============================================================================
+// Merges the runs in files into out, each read through buffer_ints.
+// Closes the files.  Returns false on an I/O error.
+static bool merge_runs(std::vector<std::FILE*>& files, std::FILE* out, Vec_Idx buffer_ints)
+{
+    std::vector<Run_Reader*> runs;
+    for (Vec_Idx idx = 0; idx < files.size(); ++idx)
+    {
+        std::rewind(files[idx]);
+        runs.push_back(new Run_Reader(files[idx], buffer_ints));
+    }
+
+    Run_Writer writer(out, buffer_ints);
+    if (!runs.empty())
+    {
+        Loser_Tree tree(runs);
+        for (; !tree.empty(); tree.pop())
+            { writer.put(tree.top()); }
+    }
+    bool ok = writer.flush();
+
+    for (Vec_Idx idx = 0; idx < runs.size(); ++idx)
+    {
+        if (runs[idx]->error()) { ok = false; }
+        delete runs[idx];
+        std::fclose(files[idx]);
+    }
+    return ok;
+}
+
+//==============================================================================
+// Sorts the native ints in the binary file input into output using about
+// budget bytes for data.  threads <= 0 sorts runs with every hardware
+// thread.  Returns false, with output unfinished, on an I/O error.
+bool external_sort(const std::string& input, const std::string& output,
+                   std::size_t budget, int threads, External_Stats& stats)
+{
+    const Vec_Idx least_buffer = (64 * 1024) / sizeof(int);
+    Vec_Idx run_ints = std::max(budget / sizeof(int), 2 * least_buffer);
+    stats._elements = 0;
+    stats._runs     = 0;
+    stats._passes   = 0;
+
+    std::FILE* in = std::fopen(input.c_str(), "rb");
+    if (in == 0) { return false; }
+
+    // Form sorted runs
+    std::vector<std::FILE*> runs;
+    bool ok = true;
+    {
+        std::vector<int> run(run_ints);
+        Vec_Idx got;
+        while (ok && (got = std::fread(&run[0], sizeof(int), run_ints, in)) > 0)
+        {
+            run.resize(got);
+            parallel_sort(run, threads);
+            std::FILE* file = std::tmpfile();
+            ok = file != 0 && std::fwrite(&run[0], sizeof(int), got, file) == got;
+            if (file != 0) { runs.push_back(file); }
+            stats._elements += got;
+            run.resize(run_ints);
+        }
+        if (std::ferror(in)) { ok = false; }
+    }
+    std::fclose(in);
+    stats._runs = runs.size();
+
+    // Merge fan_in runs at a time until one pass can write the output
+    Vec_Idx fan_in = std::max<Vec_Idx>(2, run_ints / least_buffer - 1);
+    while (ok && runs.size() > fan_in)
+    {
+        std::vector<std::FILE*> merged;
+        Vec_Idx first = 0;
+        for (; ok && first < runs.size(); first += fan_in)
+        {
+            std::vector<std::FILE*> group(runs.begin() + first,
+                                          runs.begin() + std::min(first + fan_in, runs.size()));
+            std::FILE* file = std::tmpfile();
+            if (file == 0) { ok = false; break; }
+            ok = merge_runs(group, file, run_ints / (group.size() + 1));
+            merged.push_back(file);
+        }
+        // merge_runs closed the groups it merged, close the rest
+        for (; first < runs.size(); ++first)
+            { std::fclose(runs[first]); }
+        runs.swap(merged);
+        ++stats._passes;
+    }
+
+    std::FILE* out = std::fopen(output.c_str(), "wb");
+    if (ok && out != 0)
+    {
+        ok = merge_runs(runs, out, run_ints / (runs.size() + 1));
+        runs.clear();
+        ++stats._passes;
+    }
+    for (Vec_Idx idx = 0; idx < runs.size(); ++idx)
+        { std::fclose(runs[idx]); }
+    if (out == 0) { return false; }
+    return std::fclose(out) == 0 && ok;
+}
@@ -10,6 +10,21 @@
 
 //==============================================================================
 #include <vector>
+#include <string>
+#include <cstddef>
+
+//==============================================================================
+// Shapes of generated input data
+enum Distribution
+{
+    UNIFORM,
+    SORTED,
+    REVERSE,
+    NEARLY_SORTED,
+    FEW_UNIQUE,
+    ORGAN_PIPE,
+    ZIPF
+};
 
 //==============================================================================
 struct Options
@@ -18,29 +33,68 @@ struct Options
     int  _seed;
     int  _data_size;
     int  _mod;
+    int  _threads;
+    Distribution _distribution;
+    int  _repetitions;
+    int  _warmup;
+    int  _cpu;
     bool _output_data;
     bool _output_sorted_data;
     bool _bubble_sort;
     bool _selection_sort;
     bool _quick_sort;
+    bool _radix_sort;
+    bool _simd_sort;
+    bool _parallel_sort;
+    std::string _input_file;
+    std::string _output_file;
+    int  _memory_mb;
 
     // Defaults
     Options()
       : _seed(0),
         _data_size(0),
         _mod(0),
+        _threads(0),
+        _distribution(UNIFORM),
+        _repetitions(0),
+        _warmup(1),
+        _cpu(-1),
         _output_data(false),
         _output_sorted_data(false),
         _bubble_sort(false),
         _selection_sort(false),
-        _quick_sort(false)
+        _quick_sort(false),
+        _radix_sort(false),
+        _simd_sort(false),
+        _parallel_sort(false),
+        _memory_mb(256)
     { }
 };
 
+//==============================================================================
+// Comparisons made by the sorts, for comparisons per element
+extern unsigned long long sort_comparisons;
+
 //==============================================================================
 void selection_sort(std::vector<int>&);
 void quick_sort(std::vector<int>&);
 void bubble_sort(std::vector<int>&);
+void radix_sort(std::vector<int>&);
+void simd_sort(std::vector<int>&);
+void parallel_sort(std::vector<int>&, int threads);
+
+//==============================================================================
+// What external_sort did
+struct External_Stats
+{
+    unsigned long long _elements;
+    unsigned long      _runs;        // Sorted runs formed
+    int                _passes;      // Merge passes over the data
+};
+
+bool external_sort(const std::string& input, const std::string& output,
+                   std::size_t budget, int threads, External_Stats& stats);
 
 #endif
 
@@ -0,0 +1,33 @@
+////////////////////////////////////////////////////////////////////
+// File:         throw.cpp
+//
+// Description:  Statements that throw partway through a run, for
+//               checking that the statements before them are counted
+//
+//
+#include <iostream>
+
+int check(int n) {
+    if (n < 0) {
+        throw n;
+    }
+    return n;
+}
+
+int main() {
+    int total = 0;
+    int caught = 0;
+    for (int i = -2; i < 3; ++i) {
+        try {
+            total += 1;
+            total += 2;
+            total += check(i);
+            total += 3;
+            total += 4;
+        } catch (int) {
+            caught += 1;
+        }
+    }
+    std::cout << total << " " << caught << std::endl;
+    return 0;
+}
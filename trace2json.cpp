@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////////////////////////
+//  trace2json.cpp
+//  Profiler
+//
+//  Converts a trace written by an instrumented program run with
+//   PROFILE_TRACE=file into Chrome Trace Event JSON, which Perfetto and
+//   chrome://tracing display as a timeline.  See profile.cpp for the
+//   trace file format.
+//
+//  Usage: trace2json trace.bin > trace.json
+//
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Writes s as a JSON string.
+//
+void writeString(std::ostream& out, const std::string& s) {
+    out << '"';
+    for (std::string::size_type i = 0; i < s.size(); ++i) {
+        char ch = s[i];
+        if (ch == '"' || ch == '\\') out << '\\' << ch;
+        else if (static_cast<unsigned char>(ch) < 0x20) out << ' ';
+        else out << ch;
+    }
+    out << '"';
+}
+
+template <typename T>
+bool readValue(std::istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        std::cerr << "Error: A trace file is required." << std::endl;
+        std::cerr << "trace2json trace.bin > trace.json" << std::endl << std::endl;
+        return(1);
+    }
+    std::ifstream in(argv[1], std::ios::binary);
+    char magic[6];
+    if (!in || !in.read(magic, 6) || std::string(magic, 6) != "PTRC1\n") {
+        std::cerr << "Error: " << argv[1] << " is not a profile trace." << std::endl;
+        return(1);
+    }
+
+    std::map<uint64_t, std::string>  name;
+    std::map<uint32_t, int>          depth;     //Open calls per thread
+    bool first = true;
+    char kind;
+
+    std::cout << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    while (in.get(kind)) {
+        if (kind == 'N') {
+            uint64_t id;
+            uint32_t n;
+            readValue(in, id);
+            readValue(in, n);
+            std::string text(n, ' ');
+            in.read(&text[0], n);
+            name[id] = text;
+        } else if (kind == 'E') {
+            uint32_t tid, n;
+            readValue(in, tid);
+            readValue(in, n);
+            for (uint32_t i = 0; i < n; ++i) {
+                uint64_t time, id;
+                readValue(in, time);
+                readValue(in, id);
+                bool exit = (time >> 63) != 0;
+                time &= ~(uint64_t(1) << 63);
+                if (exit) {
+                    if (depth[tid] == 0) continue;      //Entry was dropped
+                    --depth[tid];
+                } else {
+                    ++depth[tid];
+                }
+                std::cout << (first ? "\n" : ",\n") << "{\"name\":";
+                writeString(std::cout, name[id]);
+                std::cout << ",\"ph\":\"" << (exit ? 'E' : 'B') << "\",\"ts\":"
+                          << time / 1000 << '.' << (time % 1000) / 100 << (time % 100) / 10 << time % 10
+                          << ",\"pid\":1,\"tid\":" << tid << "}";
+                first = false;
+            }
+        } else if (kind == 'D') {
+            uint32_t tid;
+            uint64_t dropped;
+            readValue(in, tid);
+            readValue(in, dropped);
+            if (dropped) std::cerr << "trace2json: thread " << tid << " dropped "
+                                   << dropped << " events" << std::endl;
+        } else {
+            std::cerr << "Error: " << argv[1] << " is corrupt." << std::endl;
+            return(1);
+        }
+    }
+    std::cout << "\n]}\n";
+    return 0;
+}